@@ -0,0 +1,321 @@
+#include "fsalloc/admin.h"
+#include "fsalloc/fsalloc.h"
+#include "fsalloc/inspect.h"
+#include "fsalloc/phase.h"
+#include "fsalloc/sites.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+using namespace fsalloc;
+using namespace fsalloc::admin;
+
+static const size_t kDefaultTop = 10;
+
+/*
+ * gListener - listening socket, -1 if not serving
+ * gWakeup   - pipe waking the thread up to stop it
+ * gPath     - path of socket
+ * gThread   - thread serving connections
+ */
+namespace {
+	int gListener = -1;
+	int gWakeup[2] = {-1, -1};
+	std::string gPath;
+	std::thread gThread;
+
+	const std::pair<const char *, unsigned long long Stats::*> kCounters[] = {
+		{"allocs", &Stats::allocs},
+		{"frees", &Stats::frees},
+		{"faults", &Stats::faults},
+		{"read_faults", &Stats::read_faults},
+		{"write_faults", &Stats::write_faults},
+		{"cache_hits", &Stats::cache_hits},
+		{"write_upgrades", &Stats::write_upgrades},
+		{"zero_fills", &Stats::zero_fills},
+		{"clean_evictions", &Stats::clean_evictions},
+		{"dirty_evictions", &Stats::dirty_evictions},
+		{"writebacks", &Stats::writebacks},
+		{"readaheads", &Stats::readaheads},
+		{"faultarounds", &Stats::faultarounds},
+		{"write_predictions", &Stats::write_predictions},
+		{"speculative_writebacks", &Stats::speculative_writebacks},
+		{"fault_syscalls", &Stats::fault_syscalls},
+		{"bytes_fetched", &Stats::bytes_fetched},
+		{"bytes_written", &Stats::bytes_written},
+		{"resident_bytes", &Stats::resident_bytes},
+		{"dirty_bytes", &Stats::dirty_bytes},
+	};
+
+	const std::pair<const char *, Histogram Stats::*> kHistograms[] = {
+		{"fault", &Stats::fault_latency},
+		{"get", &Stats::get_latency},
+		{"put", &Stats::put_latency},
+	};
+}
+
+/*! \brief Parses "on" or "off" */
+static bool toggle(const std::string &word) {
+	if (word != "on" && word != "off") {
+		throw std::invalid_argument("expected on or off");
+	}
+	return word == "on";
+}
+
+/*! \brief Reads next argument of a command, failing if it is missing or malformed */
+template<typename T>
+static T argument(std::istringstream &args) {
+	T value;
+	if (!(args >> value)) {
+		throw std::invalid_argument("missing or malformed argument");
+	}
+	return value;
+}
+
+/*! \brief Returns output written by 'print' to a FILE */
+template<typename Print>
+static std::string capture(Print print) {
+	char *buffer = nullptr;
+	size_t size = 0;
+
+	FILE *out = open_memstream(&buffer, &size);
+	if (out == nullptr) {
+		throw std::runtime_error("out of memory");
+	}
+	print(out);
+	fclose(out);
+
+	std::string output(buffer, size);
+	free(buffer);
+	return output;
+}
+
+std::string fsalloc::admin::execute(const std::string &command) {
+	std::istringstream args(command);
+	std::ostringstream out;
+	std::string name;
+
+	args >> name;
+	try {
+		if (name == "stats") {
+			Stats stats = fsalloc::stats();
+			for (auto &counter : kCounters) {
+				out << counter.first << ": " << stats.*counter.second << "\n";
+			}
+		} else if (name == "histograms") {
+			Stats stats = fsalloc::stats();
+			for (auto &histogram : kHistograms) {
+				const Histogram &h = stats.*histogram.second;
+				out << histogram.first << ": count " << h.count
+					<< " mean_ns " << (h.count > 0 ? h.total / h.count : 0)
+					<< " p50_ns " << h.percentile(0.50)
+					<< " p90_ns " << h.percentile(0.90)
+					<< " p99_ns " << h.percentile(0.99)
+					<< " p999_ns " << h.percentile(0.999)
+					<< " max_ns " << h.percentile(1) << "\n";
+			}
+		} else if (name == "top") {
+			size_t count = (args >> std::ws).eof() ? kDefaultTop : argument<size_t>(args);
+			for (const Region &region : hottest(count)) {
+				out << region.addr << " size " << region.info.size << " heat " << region.info.heat
+					<< (region.info.cached ? " cached" : "") << (region.info.dirty ? " dirty" : "") << "\n";
+			}
+		} else if (name == "cache") {
+			Occupancy cache = occupancy();
+			Stats stats = fsalloc::stats();
+			out << "capacity: " << cache.capacity << "\n"
+				<< "cached: " << cache.cached << "\n"
+				<< "dirty: " << cache.dirty << "\n"
+				<< "allocated: " << cache.allocated << "\n"
+				<< "metadata_capacity: " << cache.metadata_capacity << "\n"
+				<< "metadata_resident: " << cache.metadata_resident << "\n"
+				<< "metadata_chunks: " << cache.metadata_chunks << "\n"
+				<< "metadata_spilled: " << cache.metadata_spilled << "\n"
+				<< "resident_bytes: " << stats.resident_bytes << "\n"
+				<< "dirty_bytes: " << stats.dirty_bytes << "\n";
+		} else if (name == "curve") {
+			mrc::Curve estimate = curve();
+			for (uint32_t i = 0; i < estimate.count; ++i) {
+				out << estimate.points[i].capacity << " ratio " << estimate.points[i].ratio
+					<< " rate " << estimate.points[i].rate << "\n";
+			}
+		} else if (name == "phases") {
+			out << capture([](FILE *file) { phase::dump(file); });
+		} else if (name == "profile") {
+			std::string profile = argument<std::string>(args), metric = argument<std::string>(args);
+			if ((profile != "access" && profile != "allocation")
+					|| (metric != "faults" && metric != "bytes" && metric != "evictions")) {
+				throw std::invalid_argument("unknown profile or metric");
+			}
+			out << capture([&](FILE *file) {
+				fsalloc::profile(file, profile == "access" ? sites::Profile::access : sites::Profile::allocation,
+						metric == "faults" ? sites::Metric::faults
+						: metric == "bytes" ? sites::Metric::bytes : sites::Metric::evictions);
+			});
+		} else if (name == "dump") {
+			inspect::dump(argument<std::string>(args));
+		} else if (name == "capacity") {
+			fsalloc::capacity(argument<uint32_t>(args));
+		} else if (name == "metadata") {
+			fsalloc::metadata(argument<uint32_t>(args));
+		} else if (name == "policy") {
+			std::string policy = argument<std::string>(args);
+			if (policy != "fifo" && policy != "clock") {
+				throw std::invalid_argument("unknown policy");
+			}
+			fsalloc::policy(policy == "fifo" ? Policy::fifo : Policy::clock);
+		} else if (name == "watermarks") {
+			double low = argument<double>(args);
+			watermarks(low, argument<double>(args));
+		} else if (name == "readahead") {
+			readahead(argument<uint32_t>(args));
+		} else if (name == "faultaround") {
+			uint32_t window = argument<uint32_t>(args);
+			std::string locality = (args >> std::ws).eof() ? "address" : argument<std::string>(args);
+			if (locality != "address" && locality != "storage") {
+				throw std::invalid_argument("unknown locality");
+			}
+			faultaround(window, locality == "address" ? Locality::address : Locality::storage);
+		} else if (name == "writeprediction") {
+			writeprediction(toggle(argument<std::string>(args)));
+		} else if (name == "transplant") {
+			transplant(toggle(argument<std::string>(args)));
+		} else if (name == "autotune") {
+			double rate = argument<double>(args);
+			autotune(rate, argument<uint32_t>(args));
+		} else if (name == "sampling") {
+			sampling(argument<uint32_t>(args));
+		} else {
+			throw std::invalid_argument("unknown command: " + name);
+		}
+	} catch (const std::exception &e) {
+		return out.str() + "error: " + e.what() + "\n";
+	}
+
+	return out.str() + "ok\n";
+}
+
+/*! \brief Writes whole buffer to socket */
+static bool reply(int fd, const std::string &data) {
+	size_t sent = 0;
+
+	while (sent < data.size()) {
+		ssize_t written = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		sent += written;
+	}
+	return true;
+}
+
+/*! \brief Serves commands of a single client until it disconnects or stop() is called */
+static void serve(int client) {
+	std::string pending;
+	char buffer[512];
+	struct pollfd fds[2] = {{client, POLLIN, 0}, {gWakeup[0], POLLIN, 0}};
+
+	while (poll(fds, 2, -1) >= 0 || errno == EINTR) {
+		if (fds[1].revents != 0) {
+			return;
+		}
+		if (fds[0].revents == 0) {
+			continue;
+		}
+
+		ssize_t received = recv(client, buffer, sizeof(buffer), 0);
+		if (received <= 0) {
+			return;
+		}
+		pending.append(buffer, received);
+
+		size_t end;
+		while ((end = pending.find('\n')) != std::string::npos) {
+			std::string command = pending.substr(0, end);
+			pending.erase(0, end + 1);
+			if (!command.empty() && !reply(client, execute(command))) {
+				return;
+			}
+		}
+	}
+}
+
+/*! \brief Accepts clients one at a time until stop() is called */
+static void loop() {
+	struct pollfd fds[2] = {{gListener, POLLIN, 0}, {gWakeup[0], POLLIN, 0}};
+
+	while (poll(fds, 2, -1) >= 0 || errno == EINTR) {
+		if (fds[1].revents != 0) {
+			return;
+		}
+		if (fds[0].revents == 0) {
+			continue;
+		}
+
+		int client = accept4(gListener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client >= 0) {
+			serve(client);
+			close(client);
+		}
+	}
+}
+
+void fsalloc::admin::start(const std::string &path) {
+	struct sockaddr_un addr;
+
+	stop();
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw std::invalid_argument("admin: socket path too long");
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size());
+
+	gListener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (gListener < 0) {
+		throw std::runtime_error("admin: could not create socket");
+	}
+	unlink(path.c_str());
+	if (bind(gListener, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0
+			|| listen(gListener, 4) < 0 || pipe2(gWakeup, O_CLOEXEC) < 0) {
+		close(gListener);
+		gListener = -1;
+		throw std::runtime_error("admin: could not listen on " + path);
+	}
+
+	gPath = path;
+	gThread = std::thread(loop);
+}
+
+void fsalloc::admin::stop() {
+	if (gListener < 0) {
+		return;
+	}
+
+	char wakeup = 0;
+	while (write(gWakeup[1], &wakeup, 1) < 0 && errno == EINTR) {
+	}
+	gThread.join();
+
+	close(gListener);
+	close(gWakeup[0]);
+	close(gWakeup[1]);
+	unlink(gPath.c_str());
+	gListener = -1;
+	gWakeup[0] = gWakeup[1] = -1;
+}
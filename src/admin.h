@@ -0,0 +1,45 @@
+#ifndef __FSALLOC_ADMIN_H
+#define __FSALLOC_ADMIN_H
+
+#include <string>
+
+namespace fsalloc { namespace admin {
+
+/*
+ * Admin control endpoint - a Unix domain socket serviced by a background
+ * thread, taking one command per line:
+ *   stats                                 all counters
+ *   histograms                            latency percentiles
+ *   top [count]                           hottest regions
+ *   cache                                 cache occupancy
+ *   curve                                 estimated miss ratio curve
+ *   phases                                fault cost breakdown, if built in
+ *   profile access|allocation faults|bytes|evictions
+ *                                         sampled call stacks, folded
+ *   dump <path>                           allocation map, for fsalloc_inspect
+ *   capacity <regions>
+ *   metadata <chunks>                     metadata kept in RAM
+ *   policy fifo|clock
+ *   watermarks <low> <high>
+ *   readahead <max_window>
+ *   faultaround <window> [address|storage]
+ *   writeprediction on|off
+ *   transplant on|off
+ *   autotune <target_rate> <budget>
+ *   sampling <every>                      call stack sampling, 0 disables
+ * Every reply ends with a line saying either "ok" or "error: <reason>", e.g.
+ *   echo "capacity 4096" | socat - UNIX-CONNECT:/run/app/fsalloc.sock
+ */
+
+/*! \brief Starts serving commands on a socket created at 'path' */
+void start(const std::string &path);
+
+/*! \brief Stops serving commands and removes the socket */
+void stop();
+
+/*! \brief Executes a single command, returning its reply */
+std::string execute(const std::string &command);
+
+} }
+
+#endif // __FSALLOC_ADMIN_H
@@ -22,6 +22,13 @@ int get_mprotect_flags(void *ctx) {
 	return flags;
 }
 
+void get_frame(void *ctx, uintptr_t &pc, uintptr_t &fp) {
+	ucontext_t *context = (ucontext_t *)ctx;
+
+	pc = context->uc_mcontext.gregs[REG_RIP];
+	fp = context->uc_mcontext.gregs[REG_RBP];
+}
+
 } // namespace x86_64
 
 int get_mprotect_flags(void *ctx) {
@@ -32,6 +39,15 @@ int get_mprotect_flags(void *ctx) {
 #endif
 }
 
+/*! \brief Extracts program counter and frame pointer of interrupted code from signal context */
+void get_frame(void *ctx, uintptr_t &pc, uintptr_t &fp) {
+#ifdef __x86_64__
+	x86_64::get_frame(ctx, pc, fp);
+#else
+#error "Support for platforms other than x86_64 is not implemented"
+#endif
+}
+
 }
 
 #endif // __FSALLOC_CPU_TRAITS_H
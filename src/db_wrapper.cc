@@ -1,47 +1,323 @@
 #include "fsalloc/fsalloc.h"
+#include "fsalloc/pool.h"
+#include "fsalloc/probes.h"
 
+#include <limits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <stdexcept>
 
 using namespace fsalloc;
 using namespace fsalloc::db;
 
+/*
+ * Records are split into size classes, each kept in a separate heap database.
+ * Pages of class 'n' are 2^n times larger than base pagesize, so that a record
+ * fits a single page instead of becoming an overflow item. Class of a record
+ * is kept in the topmost bits of its page number.
+ *
+ * gEnvironment - private environment with memory pool shared by all databases
+ * gDatabases   - heap databases of every size class, opened on first use
+ * gIndex       - regions stored in databases, keyed by their handles in storage order
+ * gPath        - absolute path of base database, others have class number appended
+ * gPagesize    - page size of base database
+ * gLogging     - true iff changes are logged, which requires transactional opens
+ * gReadonly    - true iff databases of another session are opened for inspection
+ * gHooked      - true iff memory of the library is allocated from the pool
+ */
 namespace {
-	database_t *gDatabase;
 	const uint32_t kGigabyte = 1024 * 1024 * 1024;
+	const uint32_t kMaxPagesize = 64 * 1024;
+	const uint32_t kPageOverhead = 32;   // page header, rounded up
+	const uint32_t kRecordOverhead = 20; // index entry and split record header, rounded up
+	const int kClassShift = 29;
+	const int kClasses = 1 << (32 - kClassShift);
+	const db_pgno_t kPageMask = (1u << kClassShift) - 1;
+
+	environment_t *gEnvironment;
+	database_t *gDatabases[kClasses];
+	database_t *gIndex;
+	std::string gPath;
+	uint32_t gPagesize;
+	bool gLogging;
+	bool gReadonly;
+	bool gHooked;
+}
+
+/*! \brief Returns rid packed into a single probe argument */
+static uint64_t packed(const handle_t &rid) {
+	return (static_cast<uint64_t>(rid.pgno) << 16) | rid.indx;
+}
+
+/*! \brief Returns size class of records of given size */
+static int sizeclass(uint32_t size) {
+	int cls = 0;
+	while (cls + 1 < kClasses && (gPagesize << cls) < kMaxPagesize
+			&& (gPagesize << cls) - kPageOverhead - kRecordOverhead < size) {
+		cls++;
+	}
+	return cls;
+}
+
+/*! \brief Writes path of database of given size class to 'path' */
+static void classPath(int cls, char *path, size_t size) {
+	if (cls == 0) {
+		snprintf(path, size, "%s", gPath.c_str());
+	} else {
+		snprintf(path, size, "%s.%d", gPath.c_str(), cls);
+	}
+}
+
+/*! \brief Opens database for given size class, returns 0 or error code
+ * Classes are opened on first use, which may happen while handling a fault, so nothing is allocated from the heap.
+ */
+static int openClass(int cls) {
+	int err;
+	database_t *database;
+	char path[PATH_MAX];
+
+	classPath(cls, path, sizeof(path));
+	if (gReadonly) {
+		if (access(path, R_OK) != 0) {
+			return 0;
+		}
+		err = db_create(&database, gEnvironment, 0);
+		if (err || (err = database->open(database, nullptr, path, nullptr, DB_HEAP, DB_RDONLY | DB_THREAD, 0))) {
+			return err;
+		}
+		gDatabases[cls] = database;
+		return 0;
+	}
+
+	err = db_create(&database, gEnvironment, 0);
+	if (err) {
+		return err;
+	}
+
+	err = database->set_pagesize(database, gPagesize << cls);
+	if (err) {
+		return err;
+	}
+
+	// Truncating is not allowed in a transactional environment, so a logged database is emptied after opening
+	err = database->open(database, nullptr, path, nullptr, DB_HEAP,
+			DB_CREATE | DB_THREAD | (gLogging ? DB_AUTO_COMMIT : DB_TRUNCATE), 0);
+	if (err) {
+		return err;
+	}
+
+	if (gLogging) {
+		u_int32_t count;
+		err = database->truncate(database, nullptr, &count, DB_AUTO_COMMIT);
+		if (err) {
+			return err;
+		}
+	}
+
+	gDatabases[cls] = database;
+	return 0;
 }
 
-void fsalloc::db::init(const std::string &path, uint32_t pagesize, uint64_t cachesize, int ncache) {
+/*! \brief Opens index of stored regions, which is truncated along with databases */
+static void openIndex() {
 	int err;
+	std::string path = gPath + ".index";
 
-	err = db_create(&gDatabase, nullptr, 0);
+	err = db_create(&gIndex, gEnvironment, 0);
 	if (err) {
 		throw std::runtime_error("Could not create database");
 	}
 
-	err = gDatabase->set_pagesize(gDatabase, pagesize);
+	err = gIndex->open(gIndex, nullptr, path.c_str(), nullptr, DB_BTREE,
+			DB_CREATE | DB_THREAD | (gLogging ? DB_AUTO_COMMIT : DB_TRUNCATE), 0);
 	if (err) {
-		throw std::runtime_error("Could not set pagesize for database");
+		throw std::runtime_error("Could not open database " + path);
+	}
+
+	if (gLogging) {
+		u_int32_t count;
+		err = gIndex->truncate(gIndex, nullptr, &count, DB_AUTO_COMMIT);
+		if (err) {
+			throw std::runtime_error("Could not truncate database");
+		}
+	}
+}
+
+/*! \brief Fills index key of a record - big endian handle, so that keys sort in storage order */
+static void indexKey(const handle_t &rid, unsigned char (&bytes)[6], entry_t &key) {
+	for (int i = 0; i < 4; ++i) {
+		bytes[i] = rid.pgno >> (24 - 8 * i);
+	}
+	bytes[4] = rid.indx >> 8;
+	bytes[5] = rid.indx;
+
+	memset(&key, 0, sizeof(key));
+	key.data = bytes;
+	key.size = sizeof(bytes);
+	key.ulen = sizeof(bytes);
+	key.flags = DB_DBT_USERMEM;
+}
+
+/*! \brief Returns database holding given record and strips size class from its handle */
+static database_t *databaseOf(handle_t &rid) {
+	database_t *database = gDatabases[rid.pgno >> kClassShift];
+	rid.pgno &= kPageMask;
+	return database;
+}
+
+/*! \brief Returns absolute path of a file - relative names would be taken relative to environment home */
+static std::string absolute(const std::string &path) {
+	char cwd[PATH_MAX];
+
+	if (!path.empty() && path[0] == '/') {
+		return path;
+	}
+	if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+		throw std::runtime_error("Could not resolve database path " + path);
 	}
+	return std::string(cwd) + "/" + path;
+}
 
-	err = gDatabase->set_cachesize(gDatabase, cachesize / kGigabyte, cachesize % kGigabyte , ncache);
+/*! \brief Returns directory containing given file */
+static std::string directory(const std::string &path) {
+	size_t slash = path.rfind('/');
+	if (slash == std::string::npos) {
+		return ".";
+	}
+	return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+void fsalloc::db::init(const std::string &path, const Options &options) {
+	int err;
+	uint32_t flags = DB_CREATE | DB_PRIVATE | DB_INIT_MPOOL | DB_THREAD;
+
+	// Databases of a previous session would not be truncated otherwise
+	term();
+
+	gPath = absolute(path);
+	gPagesize = options.pagesize ? options.pagesize : kPagesize;
+	gLogging = options.logging;
+	gReadonly = options.readonly;
+
+	// Memory of the library comes from the pool, so that faults may be handled while malloc is locked;
+	// hooks are process-wide and must be in place before the first environment is created
+	if (!gHooked) {
+		pool::init();
+		db_env_set_func_malloc(pool::allocate);
+		db_env_set_func_realloc(pool::reallocate);
+		db_env_set_func_free(pool::deallocate);
+		gHooked = true;
+	}
+
+	err = db_env_create(&gEnvironment, 0);
+	if (err) {
+		throw std::runtime_error("Could not create database environment");
+	}
+
+	// Memory handed over to the caller, such as statistics, is still released with free()
+	err = gEnvironment->set_alloc(gEnvironment, malloc, realloc, free);
 	if (err) {
-		throw std::runtime_error("Could not set cachesize for database");
+		throw std::runtime_error("Could not set allocator for database environment");
 	}
 
-	err = gDatabase->open(gDatabase, nullptr, path.c_str(), nullptr, DB_HEAP, DB_CREATE | DB_TRUNCATE, 0);
+	err = gEnvironment->set_cachesize(gEnvironment, options.mpool_size / kGigabyte, options.mpool_size % kGigabyte, 1);
 	if (err) {
-		throw std::runtime_error("Could not open database");
+		throw std::runtime_error("Could not set cachesize for database environment");
+	}
+
+	if (options.mmap_size) {
+		err = gEnvironment->set_mp_mmapsize(gEnvironment, options.mmap_size);
+		if (err) {
+			throw std::runtime_error("Could not set mmap size for database environment");
+		}
+	}
+
+	if (!options.single_writer) {
+		flags |= DB_INIT_LOCK;
+	}
+	if (options.logging) {
+		flags |= DB_INIT_LOG | DB_INIT_TXN;
+	}
+
+	err = gEnvironment->open(gEnvironment, directory(gPath).c_str(), flags, 0);
+	if (err) {
+		throw std::runtime_error("Could not open database environment");
+	}
+
+	if (gReadonly) {
+		for (int cls = 0; cls < kClasses; ++cls) {
+			if (openClass(cls)) {
+				throw std::runtime_error("Could not open database " + gPath);
+			}
+		}
+	} else {
+		// Classes are only truncated once opened, so those left by a previous session are removed
+		// instead - their stale records would be taken as part of this store when inspected
+		for (int cls = 1; cls < kClasses; ++cls) {
+			char path[PATH_MAX];
+			classPath(cls, path, sizeof(path));
+			if (unlink(path) != 0 && errno != ENOENT) {
+				throw std::runtime_error(std::string("Could not remove database ") + path);
+			}
+		}
+		if (openClass(0)) {
+			throw std::runtime_error("Could not open database " + gPath);
+		}
+		openIndex();
 	}
 }
 
 void fsalloc::db::term() {
-	gDatabase->close(gDatabase, DB_NOSYNC);
+	if (gIndex) {
+		gIndex->close(gIndex, DB_NOSYNC);
+		gIndex = nullptr;
+	}
+	for (auto &database : gDatabases) {
+		if (database) {
+			database->close(database, DB_NOSYNC);
+			database = nullptr;
+		}
+	}
+
+	if (gEnvironment) {
+		gEnvironment->close(gEnvironment, 0);
+		gEnvironment = nullptr;
+	}
+}
+
+uint32_t fsalloc::db::pagesize(uint32_t size) {
+	return gPagesize << sizeclass(size);
+}
+
+void fsalloc::db::get(handle_t rid, void *buffer, uint32_t size) {
+	if (read(rid, buffer, size)) {
+		throw std::runtime_error("Getting from database failed");
+	}
+}
+
+handle_t fsalloc::db::put(void *element, uint32_t size) {
+	handle_t rid;
+	if (append(element, size, rid)) {
+		throw std::runtime_error("Putting to database failed");
+	}
+	return rid;
+}
+
+void fsalloc::db::put(void *element, uint32_t size, handle_t rid) {
+	if (write(element, size, rid)) {
+		throw std::runtime_error("Commiting changes to database entry failed");
+	}
 }
 
-char *fsalloc::db::get(handle_t rid) {
+int fsalloc::db::read(handle_t rid, void *buffer, uint32_t size) {
 	int err;
 	entry_t key, data;
+	uint64_t start = FSALLOC_PROBE_ENABLED(db__get) ? probes::now() : 0;
 
 	memset(&key, 0, sizeof(entry_t));
 	memset(&data, 0, sizeof(entry_t));
@@ -51,18 +327,27 @@ char *fsalloc::db::get(handle_t rid) {
 	key.ulen = sizeof(rid);
 	key.flags = DB_DBT_USERMEM;
 
-	err = gDatabase->get(gDatabase, 0, &key, &data, 0);
+	// Record is copied straight to the caller's buffer instead of memory owned by database;
+	// it is read partially, as a resized region is only written back whole on its next writeback
+	data.data = buffer;
+	data.ulen = size;
+	data.dlen = size;
+	data.flags = DB_DBT_USERMEM | DB_DBT_PARTIAL;
 
+	database_t *database = databaseOf(rid);
+	err = database->get(database, 0, &key, &data, 0);
 	if (err) {
-		throw std::runtime_error("Getting from database failed");
+		return err;
 	}
-	return reinterpret_cast<char *>(data.data);
+	FSALLOC_PROBE3(db__get, packed(rid), size, probes::now() - start);
+	return 0;
 }
 
-handle_t fsalloc::db::put(void *element, uint32_t size) {
+int fsalloc::db::append(void *element, uint32_t size, handle_t &rid) {
 	int err;
 	entry_t key, data;
-	handle_t rid;
+	uint64_t start = FSALLOC_PROBE_ENABLED(db__put) ? probes::now() : 0;
+
 	memset(&key, 0, sizeof(key));
 	memset(&data, 0, sizeof(data));
 
@@ -75,23 +360,35 @@ handle_t fsalloc::db::put(void *element, uint32_t size) {
 	data.data = element;
 	data.flags = DB_DBT_USERMEM;
 
-	err = gDatabase->put(gDatabase, nullptr, &key, &data, DB_APPEND);
+	int cls = sizeclass(size);
+	if (!gDatabases[cls]) {
+		if (gReadonly) {
+			return EACCES;
+		}
+		if ((err = openClass(cls))) {
+			return err;
+		}
+	}
+	database_t *database = gDatabases[cls];
+	err = database->put(database, nullptr, &key, &data, DB_APPEND);
 	if (err) {
-		throw std::runtime_error("Putting to database failed");
+		return err;
 	}
 
-	return rid;
+	if (rid.pgno > kPageMask) {
+		// Size class is full
+		return ENOSPC;
+	}
+	rid.pgno |= static_cast<db_pgno_t>(cls) << kClassShift;
+	FSALLOC_PROBE3(db__put, packed(rid), size, probes::now() - start);
+	return 0;
 }
 
-void fsalloc::db::put(void *element, uint32_t size, handle_t rid) {
+/*! \brief Overwrites record addressed by its rid, as part of transaction 'txn' if not null */
+static int overwrite(DB_TXN *txn, void *element, uint32_t size, handle_t rid) {
 	int err;
-	cursor_t *cursor;
 	entry_t key, data;
-
-	err = gDatabase->cursor(gDatabase, nullptr, &cursor, 0);
-	if (err) {
-		throw std::runtime_error("Creating cursor for database failed");
-	}
+	uint64_t start = FSALLOC_PROBE_ENABLED(db__put) ? probes::now() : 0;
 
 	memset(&key, 0, sizeof(key));
 	memset(&data, 0, sizeof(data));
@@ -101,25 +398,62 @@ void fsalloc::db::put(void *element, uint32_t size, handle_t rid) {
 	key.ulen = sizeof(rid);
 	key.flags = DB_DBT_USERMEM;
 
-	err = cursor->c_get(cursor, &key, &data, DB_SET); // Set - search by key
-	if (err) {
-		throw std::runtime_error("Getting cursor from database failed");
-	}
-
 	data.size = size;
 	data.data = element;
 	data.flags = DB_DBT_USERMEM;
 
-	err = cursor->c_put(cursor, &key, &data, DB_CURRENT);
+	// Heap record is overwritten in place when addressed by its rid
+	database_t *database = databaseOf(rid);
+	err = database->put(database, txn, &key, &data, 0);
 	if (err) {
-		throw std::runtime_error("Commiting changes to database entry failed");
+		return err;
 	}
+	FSALLOC_PROBE3(db__put, packed(rid), size, probes::now() - start);
+	return 0;
+}
 
-	cursor->c_close(cursor);
+int fsalloc::db::write(void *element, uint32_t size, handle_t rid) {
+	return overwrite(nullptr, element, size, rid);
 }
 
-void fsalloc::db::del(handle_t rid) {
+int fsalloc::db::write_batch(update_t *updates, size_t count) {
+	uint64_t start = FSALLOC_PROBE_ENABLED(db__put__batch) ? probes::now() : 0;
 	int err;
+
+	// Updates of records sharing a database page are issued one after another
+	std::sort(updates, updates + count, [](const update_t &a, const update_t &b) {
+		return a.rid.pgno < b.rid.pgno || (a.rid.pgno == b.rid.pgno && a.rid.indx < b.rid.indx);
+	});
+
+	// Logged updates are committed together instead of one by one
+	DB_TXN *txn = nullptr;
+	if (gLogging && (err = gEnvironment->txn_begin(gEnvironment, nullptr, &txn, 0))) {
+		return err;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		if ((err = overwrite(txn, updates[i].element, updates[i].size, updates[i].rid))) {
+			if (txn) {
+				txn->abort(txn);
+			}
+			return err;
+		}
+	}
+	if (txn && (err = txn->commit(txn, 0))) {
+		return err;
+	}
+	FSALLOC_PROBE2(db__put__batch, count, probes::now() - start);
+	return 0;
+}
+
+void fsalloc::db::del(handle_t rid) {
+	int err = remove(rid);
+	if (err && err != DB_NOTFOUND) {
+		throw std::runtime_error("Getting from database failed");
+	}
+}
+
+int fsalloc::db::remove(handle_t rid) {
 	entry_t key;
 
 	memset(&key, 0, sizeof(entry_t));
@@ -129,8 +463,152 @@ void fsalloc::db::del(handle_t rid) {
 	key.ulen = sizeof(rid);
 	key.flags = DB_DBT_USERMEM;
 
-	err = gDatabase->del(gDatabase, 0, &key, 0);
-	if (err && err != DB_NOTFOUND) {
-		throw std::runtime_error("Getting from database failed");
+	database_t *database = databaseOf(rid);
+	if (!database) {
+		return 0;
+	}
+	FSALLOC_PROBE1(db__del, packed(rid));
+	return database->del(database, 0, &key, 0);
+}
+
+int fsalloc::db::classOf(const handle_t &rid) {
+	return rid.pgno >> kClassShift;
+}
+
+bool fsalloc::db::fits(const handle_t &rid, uint32_t size) {
+	return classOf(rid) == sizeclass(size);
+}
+
+db_pgno_t fsalloc::db::pageOf(const handle_t &rid) {
+	return rid.pgno & kPageMask;
+}
+
+void fsalloc::db::sync() {
+	for (auto database : gDatabases) {
+		if (database && database->sync(database, 0)) {
+			throw std::runtime_error("Syncing database failed");
+		}
+	}
+}
+
+std::vector<sizeclass_t> fsalloc::db::classes() {
+	std::vector<sizeclass_t> classes;
+
+	for (int cls = 0; cls < kClasses; ++cls) {
+		database_t *database = gDatabases[cls];
+		DB_HEAP_STAT *stat;
+		if (!database) {
+			continue;
+		}
+
+		if (database->stat(database, nullptr, &stat, 0)) {
+			throw std::runtime_error("Getting database statistics failed");
+		}
+		classes.push_back({cls, stat->heap_pagesize, stat->heap_pagecnt, stat->heap_nrecs});
+		free(stat);
+	}
+	return classes;
+}
+
+void fsalloc::db::scan(const std::function<void(const handle_t &rid, uint32_t size)> &visit) {
+	for (int cls = 0; cls < kClasses; ++cls) {
+		database_t *database = gDatabases[cls];
+		cursor_t *cursor;
+		entry_t key, data;
+		handle_t rid;
+		int err;
+
+		if (!database) {
+			continue;
+		}
+
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+		key.data = &rid;
+		key.ulen = sizeof(rid);
+		key.flags = DB_DBT_USERMEM;
+		// Records are read whole into a single buffer, grown by database as needed
+		data.flags = DB_DBT_REALLOC;
+
+		if (database->cursor(database, nullptr, &cursor, 0)) {
+			throw std::runtime_error("Could not create database cursor");
+		}
+		while ((err = cursor->get(cursor, &key, &data, DB_NEXT)) == 0) {
+			rid.pgno |= static_cast<db_pgno_t>(cls) << kClassShift;
+			visit(rid, data.size);
+		}
+		cursor->close(cursor);
+		free(data.data);
+
+		if (err != DB_NOTFOUND) {
+			throw std::runtime_error("Scanning database failed");
+		}
+	}
+}
+
+int fsalloc::db::index(const handle_t &rid, uint32_t region) {
+	unsigned char bytes[6];
+	entry_t key, data;
+
+	indexKey(rid, bytes, key);
+	memset(&data, 0, sizeof(data));
+	data.data = &region;
+	data.size = sizeof(region);
+	data.flags = DB_DBT_USERMEM;
+
+	return gIndex->put(gIndex, nullptr, &key, &data, 0);
+}
+
+int fsalloc::db::unindex(const handle_t &rid) {
+	unsigned char bytes[6];
+	entry_t key;
+
+	indexKey(rid, bytes, key);
+	return gIndex->del(gIndex, nullptr, &key, 0);
+}
+
+int fsalloc::db::lookup(const handle_t &rid, uint32_t &region) {
+	unsigned char bytes[6];
+	entry_t key, data;
+
+	indexKey(rid, bytes, key);
+	memset(&data, 0, sizeof(data));
+	data.data = &region;
+	data.ulen = sizeof(region);
+	data.flags = DB_DBT_USERMEM;
+
+	return gIndex->get(gIndex, nullptr, &key, &data, 0);
+}
+
+int fsalloc::db::neighbour(handle_t &rid, uint32_t &region, bool forward) {
+	unsigned char bytes[6], origin[6];
+	entry_t key, data;
+	cursor_t *cursor;
+	int err;
+
+	// Key buffer is overwritten with keys the cursor moves to
+	indexKey(rid, bytes, key);
+	memcpy(origin, bytes, sizeof(origin));
+	memset(&data, 0, sizeof(data));
+	data.data = &region;
+	data.ulen = sizeof(region);
+	data.flags = DB_DBT_USERMEM;
+
+	if ((err = gIndex->cursor(gIndex, nullptr, &cursor, 0))) {
+		return err;
+	}
+	// Cursor lands on the record itself or the first one after it
+	err = cursor->get(cursor, &key, &data, DB_SET_RANGE);
+	if (forward && err == 0 && memcmp(bytes, origin, sizeof(bytes)) == 0) {
+		err = cursor->get(cursor, &key, &data, DB_NEXT);
+	} else if (!forward) {
+		err = cursor->get(cursor, &key, &data, err == DB_NOTFOUND ? DB_LAST : DB_PREV);
+	}
+	cursor->close(cursor);
+
+	if (err == 0) {
+		rid.pgno = static_cast<db_pgno_t>(bytes[0]) << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+		rid.indx = bytes[4] << 8 | bytes[5];
 	}
+	return err;
 }
@@ -2,7 +2,9 @@
 #define __FSALLOC_DB_WRAPPER_H
 
 #include <db.h>
+#include <functional>
 #include <string>
+#include <vector>
 
 namespace fsalloc { namespace db {
 
@@ -10,12 +12,41 @@ typedef DB_HEAP_RID handle_t;
 typedef DBC cursor_t;
 typedef DBT entry_t;
 typedef DB database_t;
+typedef DB_ENV environment_t;
 
-void init(const std::string &path, uint32_t pagesize, uint64_t cachesize, int ncache);
+/*! \brief Tuning of storage backend */
+struct Options {
+	uint64_t mpool_size = 64 * 1024 * 1024; /*!< size of memory pool caching database pages */
+	uint32_t pagesize = 0;       /*!< page size of smallest size class, 0 for system page size */
+	bool single_writer = true;   /*!< no locking, only one thread at a time accesses database */
+	bool logging = false;        /*!< write-ahead log of database changes */
+	size_t mmap_size = 0;        /*!< max size of database file mapped instead of read through pool, 0 for default */
+	bool readonly = false;       /*!< open databases left by another session as they are, for inspection */
+};
+
+/*! \brief Single record update within a batch */
+struct update_t {
+	handle_t rid;
+	void *element;
+	uint32_t size;
+};
+
+/*! \brief Database of a single size class */
+struct sizeclass_t {
+	int cls;
+	uint32_t pagesize;
+	uint64_t pages;   /*!< number of pages in database file */
+	uint64_t records; /*!< number of records stored */
+};
+
+/*! \brief Opens database in a private environment configured with 'options';
+ * larger records are kept in sibling databases with pages big enough to hold them whole
+ */
+void init(const std::string &path, const Options &options);
 
 void term();
 
-char *get(handle_t rid);
+void get(handle_t rid, void *buffer, uint32_t size);
 
 handle_t put(void *element, uint32_t size);
 
@@ -23,6 +54,62 @@ void put(void *element, uint32_t size, handle_t rid);
 
 void del(handle_t rid);
 
+/*
+ * Record operations below, like those of the index further on, are called
+ * while handling faults - they neither throw nor allocate from the heap, and
+ * return 0 or an error code.
+ */
+
+/*! \brief Reads up to 'size' bytes of a record, which may be shorter */
+int read(handle_t rid, void *buffer, uint32_t size);
+
+/*! \brief Stores a new record, setting its handle */
+int append(void *element, uint32_t size, handle_t &rid);
+
+int write(void *element, uint32_t size, handle_t rid);
+
+/*! \brief Overwrites many existing records, sorting them in storage order first;
+ * logged updates are committed in a single transaction
+ */
+int write_batch(update_t *updates, size_t count);
+
+int remove(handle_t rid);
+
+/*! \brief Returns size of database page which stores records of given size */
+uint32_t pagesize(uint32_t size);
+
+/*! \brief Returns size class of a stored record */
+int classOf(const handle_t &rid);
+
+/*! \brief Returns true iff a record of given size belongs to the size class of 'rid' */
+bool fits(const handle_t &rid, uint32_t size);
+
+/*! \brief Returns page of a stored record within its size class database */
+db_pgno_t pageOf(const handle_t &rid);
+
+/*! \brief Writes all cached database pages to files */
+void sync();
+
+/*! \brief Returns every size class in use */
+std::vector<sizeclass_t> classes();
+
+/*! \brief Calls 'visit' with handle and size of every stored record, in storage order */
+void scan(const std::function<void(const handle_t &rid, uint32_t size)> &visit);
+
+/*! \brief Notes that record 'rid' holds contents of 'region', in an index ordered by storage position */
+int index(const handle_t &rid, uint32_t region);
+
+/*! \brief Drops record from the index, returns DB_NOTFOUND if it was not indexed */
+int unindex(const handle_t &rid);
+
+/*! \brief Sets region held by an indexed record, returns DB_NOTFOUND if record is not indexed */
+int lookup(const handle_t &rid, uint32_t &region);
+
+/*! \brief Moves 'rid' to the nearest indexed record after it (or before it, unless 'forward' is set),
+ * returns DB_NOTFOUND if there is none
+ */
+int neighbour(handle_t &rid, uint32_t &region, bool forward);
+
 } }
 
 #endif // __FSALLOC_DB_WRAPPER_H
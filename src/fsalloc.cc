@@ -1,187 +1,1312 @@
 #include "fsalloc/fsalloc.h"
 #include "fsalloc/cpu_traits.h"
+#include "fsalloc/phase.h"
+#include "fsalloc/probes.h"
+#include "fsalloc/sites.h"
+#include "fsalloc/trace.h"
 
 #include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
 
 using namespace fsalloc;
+using fsalloc::table::region_t;
 
 const db::handle_t Info::invalid_handle = {
 			std::numeric_limits<decltype(rid.pgno)>::max(),
 			std::numeric_limits<decltype(rid.indx)>::max()
 	};
 
+/*! \brief Describes a stream of faults, either in address space or in storage */
+struct Stream {
+	intptr_t last;   /*!< position of last fault in stream */
+	intptr_t stride; /*!< distance between two last faults */
+	intptr_t next;   /*!< first position which was not read ahead yet */
+	intptr_t marker; /*!< position which continues the stream when touched */
+	uint32_t window; /*!< current readahead window, 0 if stream is not sequential */
+};
+
+/*! \brief Queue of regions cached in RAM, linked both ways through their metadata */
+struct RegionCache {
+	region_t head; /*!< oldest region */
+	region_t tail; /*!< newest region */
+	size_t size;
+};
+
+/*! \brief Statistics of a single thread, kept for reuse once the thread exits */
+struct Shard {
+	Stats stats;
+	Shard *next;
+	std::atomic<bool> busy; /*!< true iff shard is owned by a running thread */
+};
+
+/*! \brief Serializes access to fsalloc state between threads, including their fault handlers
+ * Code holding the lock never touches inaccessible regions, so a thread cannot fault while holding it.
+ */
+class Spinlock {
+public:
+	void lock() {
+		while (flag_.test_and_set(std::memory_order_acquire)) {
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#endif
+		}
+	}
+
+	void unlock() {
+		flag_.clear(std::memory_order_release);
+	}
+
+private:
+	std::atomic_flag flag_ = ATOMIC_FLAG_INIT;
+};
+
+/*! \brief Holds lock for a single operation, letting metadata it paged in go when done */
+class Guard {
+public:
+	explicit Guard(Spinlock &lock) : lock_(lock) {
+		lock_.lock();
+	}
+
+	~Guard() {
+		table::release();
+		lock_.unlock();
+	}
+
+	Guard(const Guard &) = delete;
+	Guard &operator=(const Guard &) = delete;
+
+private:
+	Spinlock &lock_;
+};
+
+/*! \brief Contents of a region installed writable in anticipation of a write, as filled */
+struct Prediction {
+	region_t id;  /*!< predicted region, or table::kNone */
+	uint64_t sum; /*!< checksum of its contents */
+};
+
+/*! \brief Pool of writable pages, transplanted into regions being filled */
+struct Staging {
+	char *base;  /*!< first page available in the pool */
+	size_t size; /*!< number of bytes available in the pool */
+};
+
+static const size_t kStagingSize = 64 * kPagesize;
+static const size_t kWritebackBatch = 16;
+static const size_t kMaxBatch = 256;
+static const uint32_t kMaxShards = 256;
+static const uint32_t kInitialReadahead = 4;
+static const unsigned kMaxWriteLikelihood = 3;
+static const size_t kPredictions = 4096;
+static const uint32_t kMinCapacity = 16;
+
 /*
- * gAllocations	        - map of allocated regions
  * gRegionCache	        - queue of regions cached in RAM
  * gRegionCacheCapacity - max capacity of region cache
- * gStats               - usage statistics
+ * gAddressStream       - stream of faults ordered by address
+ * gHandleStream        - stream of faults ordered by storage handle
+ * gReadaheadMax        - max number of regions read ahead at once
+ * gFaultAround         - number of neighbours loaded around a faulting region
+ * gLocality            - locality used to pick neighbours for fault-around
+ * gWritePrediction     - true iff regions likely to be written are installed writable
+ * gPredictions         - checksums of predicted regions, direct-mapped by id - a region whose entry
+ *                        was taken over is not known to be written or not
+ * gStaging             - pages used to prepare region contents before transplanting
+ * gTransplant          - true iff regions are filled through staging pages
+ * gSyscalls            - number of memory management syscalls issued so far
+ * gBatch               - records written back together, preallocated so that faults never allocate
+ * gBatched             - number of records in gBatch
+ * gPolicy              - eviction policy
+ * gLowWatermark        - fraction of capacity the flusher cleans dirty regions down to
+ * gHighWatermark       - fraction of capacity of dirty regions which starts the flusher, 0 if disabled
+ * gDirty               - number of dirty regions
+ * gLock                - guards all of the above
+ * gTargetRate          - fault rate autotuning aims for, 0 if disabled
+ * gBudget              - max capacity autotuning may set
+ * gShards              - statistics of all threads that ever touched fsalloc
+ * gShardPool           - shards handed out to threads, as a thread may first show up in a fault handler
+ * gShardsTaken         - number of shards ever handed out
+ * gShardKey            - releases shard of an exiting thread
+ * tShard               - statistics of current thread
+ * tFaulting            - true iff current thread is handling a fault
  * default_sigsegv      - default handler for SIGSEGV signal
  */
 namespace {
-	AllocMap gAllocations;
-	RegionCache gRegionCache;
+	RegionCache gRegionCache = {table::kNone, table::kNone, 0};
 	uint32_t gRegionCacheCapacity;
-	Stats gStats;
+	Stream gAddressStream;
+	Stream gHandleStream;
+	uint32_t gReadaheadMax = kDefaultReadahead;
+	uint32_t gFaultAround;
+	Locality gLocality;
+	bool gWritePrediction = true;
+	Prediction gPredictions[kPredictions];
+	Staging gStaging;
+	bool gTransplant = true;
+	unsigned long long gSyscalls;
+	db::update_t gBatch[kMaxBatch];
+	size_t gBatched;
+	Policy gPolicy;
+	double gLowWatermark;
+	double gHighWatermark;
+	size_t gDirty;
+	Spinlock gLock;
+	double gTargetRate;
+	uint32_t gBudget;
+	std::atomic<Shard *> gShards;
+	Shard gShardPool[kMaxShards];
+	std::atomic<uint32_t> gShardsTaken;
+	pthread_key_t gShardKey;
+	pthread_once_t gShardOnce = PTHREAD_ONCE_INIT;
+	thread_local Shard *tShard;
+	thread_local bool tFaulting;
 
 	struct sigaction default_sigsegv;
 }
 
-/*! \brief Inserts region to cache, performing a writeback if limit is reached */
-static void cacheRegion(void *addr) {
-	gRegionCache.push_back(addr);
+static_assert(sizeof(Stats) % sizeof(unsigned long long) == 0, "Stats must consist of counters only");
+
+/*! \brief Returns statistics of current thread, taking over a shard of an exited thread if possible */
+static Stats &local() {
+	if (tShard != nullptr) {
+		return tShard->stats;
+	}
+
+	for (Shard *shard = gShards; shard != nullptr && tShard == nullptr; shard = shard->next) {
+		bool busy = false;
+		if (shard->busy.compare_exchange_strong(busy, true)) {
+			tShard = shard;
+		}
+	}
+	if (tShard == nullptr) {
+		uint32_t taken = gShardsTaken++;
+		if (taken >= kMaxShards) {
+			// Threads beyond the pool share its last shard, where concurrent updates may get lost
+			tShard = &gShardPool[kMaxShards - 1];
+			return tShard->stats;
+		}
+		tShard = &gShardPool[taken];
+		tShard->busy = true;
+		tShard->next = gShards;
+		while (!gShards.compare_exchange_weak(tShard->next, tShard)) {
+		}
+	}
+
+	pthread_setspecific(gShardKey, tShard);
+	return tShard->stats;
+}
+
+/*! \brief Adds to a counter of current thread, which other threads may read at any time */
+static void add(unsigned long long &counter, unsigned long long value = 1) {
+	__atomic_store_n(&counter, counter + value, __ATOMIC_RELAXED);
+}
 
-	if (gRegionCache.size() > gRegionCacheCapacity) {
-		writeback();
+/*! \brief Returns monotonic time in nanoseconds */
+static unsigned long long now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*! \brief Adds a latency sample, in nanoseconds, to a histogram of current thread */
+static void sample(Histogram &histogram, unsigned long long ns) {
+	int bucket = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+	add(histogram.buckets[std::min(bucket, kHistogramBuckets - 1)]);
+	add(histogram.count);
+	add(histogram.total, ns);
+}
+
+unsigned long long Histogram::percentile(double p) const {
+	unsigned long long seen = 0;
+
+	for (int i = 0; i < kHistogramBuckets; ++i) {
+		seen += buckets[i];
+		if (seen > 0 && seen >= p * count) {
+			return (2ULL << i) - 1;
+		}
 	}
+	return 0;
 }
 
-/*! \brief Verifies if requested address is within allocated region */
-static bool verify(void *region, void *addr, uint32_t size) {
-	int dist = std::distance(reinterpret_cast<char *>(region), reinterpret_cast<char *>(addr));
-	return dist >= 0 && static_cast<uint32_t>(dist) <= size;
+/*! \brief Writes a string to stderr with a plain system call */
+static void say(const char *text) {
+	ssize_t written = write(STDERR_FILENO, text, strlen(text));
+	(void)written;
+}
+
+void fsalloc::fail(const char *what, int err) {
+	char code[24], *digit = code + sizeof(code);
+	unsigned value = err < 0 ? -err : err;
+
+	if (!tFaulting) {
+		throw std::runtime_error(std::string(what) + ": " + db_strerror(err));
+	}
+
+	// Only async-signal-safe calls from here on - the interrupted thread may hold any lock
+	*--digit = '\0';
+	do {
+		*--digit = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+	if (err < 0) {
+		*--digit = '-';
+	}
+	say("fsalloc: ");
+	say(what);
+	say(" while handling a fault, error ");
+	say(digit);
+	say("\n");
+	abort();
+}
+
+/*! \brief Returns region starting at given address, or table::kNone */
+static region_t at(void *addr) {
+	region_t id = find(addr);
+	return allocated(id) && table::address(id) == addr ? id : table::kNone;
 }
 
 /*! \brief Performs mprotect() call, protecting a page from reading/writing */
 static void protect(void *region, size_t size, int flags) {
+	FSALLOC_PHASE(protect);
 	int err = mprotect(region, sizealign(size), flags);
+	gSyscalls++;
 	if (err) {
-		throw std::runtime_error("mprotect failed");
+		fail("mprotect failed", errno);
 	}
 }
 
-/*! \brief Performs a madvise(MADV_DONTNEED) call, effectively removing page from RAM */
+/*! \brief Replaces region with fresh inaccessible pages, effectively removing its page frames from RAM */
 static void forget(void *region, size_t size) {
-	int err = madvise(region, sizealign(size), MADV_DONTNEED);
-	if (err) {
-		throw std::runtime_error("madvise failed");
+	FSALLOC_PHASE(remap);
+	void *addr = mmap(region, sizealign(size), PROT_NONE, MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	gSyscalls++;
+	if (addr == MAP_FAILED) {
+		fail("mmap failed", errno);
 	}
-	protect(region, size, PROT_NONE);
 }
 
-void fsalloc::writeback() {
-	assert(gRegionCache.size() > 0);
+/*! \brief Returns writable pages for preparing contents of a region of given size */
+static char *stage(size_t size) {
+	char *pages;
 
-	//Remove page from cache
-	void *addr = gRegionCache.front();
-	Info &info = gAllocations[addr];
-	gRegionCache.pop_front();
-	info.cached = false;
+	size = sizealign(size);
+	if (gStaging.size < size) {
+		if (gStaging.size > 0) {
+			munmap(gStaging.base, gStaging.size);
+			gSyscalls++;
+		}
+		pages = reinterpret_cast<char *>(mmap(nullptr, kStagingSize, PROT_READ | PROT_WRITE,
+				MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+		gSyscalls++;
+		if (pages == MAP_FAILED) {
+			gStaging = Staging();
+			fail("mmap failed", errno);
+		}
+		gStaging = {pages, kStagingSize};
+	}
+
+	pages = gStaging.base;
+	gStaging.base += size;
+	gStaging.size -= size;
+	return pages;
+}
 
-	if (!info.dirty) {
-		forget(addr, info.size);
-		gStats.cache_hits++;
+/*! \brief Moves prepared pages in place of region with a single mremap() call */
+static void transplant(char *pages, void *region, size_t size) {
+	FSALLOC_PHASE(remap);
+	void *addr = mremap(pages, sizealign(size), sizealign(size), MREMAP_MAYMOVE | MREMAP_FIXED, region);
+	gSyscalls++;
+	if (addr == MAP_FAILED) {
+		fail("mremap failed", errno);
+	}
+}
+
+/*! \brief Moves page frames of a region to another slot with mremap()
+ * Pages of a region come from several mappings once it was filled, forgotten or grown piecewise, and
+ * older kernels refuse to move more than one mapping per call - such ranges are split until they fit one.
+ */
+static void relocate(char *from, char *to, size_t size) {
+	FSALLOC_PHASE(remap);
+	size = sizealign(size);
+	for (size_t done = 0, length = size; done < size; length = size - done) {
+		void *addr;
+		while ((addr = mremap(from + done, length, length, MREMAP_MAYMOVE | MREMAP_FIXED, to + done)) == MAP_FAILED
+				&& errno == EFAULT && length > static_cast<size_t>(kPagesize)) {
+			gSyscalls++;
+			length = sizealign(length / 2);
+		}
+		gSyscalls++;
+		if (addr == MAP_FAILED) {
+			int err = errno;
+			// Pages moved so far go back, so that the region stays whole
+			if (done > 0) {
+				relocate(to, from, done);
+			}
+			fail("mremap failed", err);
+		}
+		done += length;
+	}
+}
+
+/*! \brief Writes a region which was not stored yet to db */
+static void store(region_t id) {
+	FSALLOC_PHASE(put);
+	unsigned long long start = now();
+	uint32_t size = table::size(id);
+	db::handle_t rid;
+	int err = db::append(table::address(id), size, rid);
+	if (err) {
+		fail("Putting to database failed", err);
+	}
+	table::handle(id, rid);
+	Stats &stats = local();
+	sample(stats.put_latency, now() - start);
+	add(stats.bytes_written, size);
+}
+
+/*! \brief Writes gBatch to db, dropping page frames of its regions unless they stay resident */
+static void storeBatch(bool resident) {
+	unsigned long long start = now(), bytes = 0;
+
+	if (gBatched == 0) {
 		return;
 	}
 
-	// Unprotect page in order to read its data
-	protect(addr, info.size, PROT_READ);
+	{
+		FSALLOC_PHASE(put);
+		int err = db::write_batch(gBatch, gBatched);
+		if (err) {
+			fail("Commiting changes to database entry failed", err);
+		}
+	}
+
+	Stats &stats = local();
+	sample(stats.put_latency, now() - start);
+	for (size_t i = 0; i < gBatched; ++i) {
+		bytes += gBatch[i].size;
+		if (!resident) {
+			forget(gBatch[i].element, gBatch[i].size);
+		}
+	}
+	add(stats.bytes_written, bytes);
+	add(stats.writebacks, gBatched);
+	gBatched = 0;
+}
+
+/*! \brief Adds a stored region to gBatch, writing the batch once it is full */
+static void batch(region_t id, void *addr, uint32_t size, bool resident) {
+	gBatch[gBatched++] = {table::handle(id), addr, size};
+	if (gBatched == kMaxBatch) {
+		storeBatch(resident);
+	}
+}
+
+/*! \brief Returns true iff region has a database record which its contents can overwrite
+ * Record of a region resized into another size class is dropped, so that the region is appended anew.
+ */
+static bool rewritable(region_t id) {
+	if (!table::stored(id)) {
+		return false;
+	}
+
+	db::handle_t rid = table::handle(id);
+	if (db::fits(rid, table::size(id))) {
+		return true;
+	}
+	int err = db::remove(rid);
+	if (err && err != DB_NOTFOUND) {
+		fail("Deleting from database failed", err);
+	}
+	table::unstore(id);
+	return false;
+}
+
+/*! \brief Reads region contents from db */
+static void fetch(const db::handle_t &rid, void *buffer, uint32_t size) {
+	FSALLOC_PHASE(get);
+	unsigned long long start = now();
+	int err = db::read(rid, buffer, size);
+	if (err) {
+		fail("Getting from database failed", err);
+	}
+	Stats &stats = local();
+	sample(stats.get_latency, now() - start);
+	add(stats.bytes_fetched, size);
+}
 
-	// Write page to db
-	if (info.valid()) {
-		db::put(addr, info.size, info.rid);
+/*! \brief Marks region as dirty or clean, keeping count of dirty bytes */
+static void mark(region_t id, bool dirty) {
+	table::State &state = table::state(id);
+	if (state.dirty != dirty) {
+		unsigned long long size = sizealign(table::size(id));
+		state.dirty = dirty;
+		gDirty += dirty ? 1 : -1;
+		add(local().dirty_bytes, dirty ? size : -size);
+	}
+}
+
+/*! \brief Appends region to cache queue */
+static void enqueue(region_t id) {
+	table::link(id) = table::kNone;
+	table::back(id) = gRegionCache.tail;
+	if (gRegionCache.tail != table::kNone) {
+		table::link(gRegionCache.tail) = id;
 	} else {
-		info.rid = db::put(addr, info.size);
+		gRegionCache.head = id;
 	}
-	info.dirty = false;
+	gRegionCache.tail = id;
+	gRegionCache.size++;
+}
 
-	// Advise as not needed - effectively freeing the page frame on Linux
-	// and reprotect
-	forget(addr, info.size);
+/*! \brief Removes region from cache queue */
+static void unlink(region_t id) {
+	region_t next = table::link(id), previous = table::back(id);
 
-	gStats.writebacks++;
+	if (previous != table::kNone) {
+		table::link(previous) = next;
+	} else {
+		gRegionCache.head = next;
+	}
+	if (next != table::kNone) {
+		table::back(next) = previous;
+	} else {
+		gRegionCache.tail = previous;
+	}
+	gRegionCache.size--;
 }
 
-AllocMap::iterator fsalloc::find(void *addr) {
-	return gAllocations.find(addr);
+/*! \brief Removes oldest region from cache queue */
+static region_t dequeue() {
+	region_t id = gRegionCache.head;
+	unlink(id);
+	return id;
 }
 
-bool fsalloc::allocated(const AllocMap::iterator &it) {
-	return it != gAllocations.end();
+/*! \brief Returns checksum of region contents, region must be readable */
+static uint64_t checksum(const void *region, uint32_t size) {
+	const uint64_t *words = static_cast<const uint64_t *>(region);
+	uint64_t sum = 0xcbf29ce484222325ULL;
+	// Pages are whole, so the tail past region size is summed too
+	for (size_t i = 0; i < sizealign(size) / sizeof(uint64_t); ++i) {
+		sum = (sum ^ words[i]) * 0x100000001b3ULL;
+	}
+	return sum;
 }
 
-void *fsalloc::fsalloc(uint32_t size) {
-	void *addr;
+/*! \brief Installs region writable and dirty if it is likely to be written soon - spares the second fault
+ * of read-then-write access. Only demand faults are predicted, neighbours loaded along stay read-only.
+ * Returns protection region is to be filled with.
+ */
+static int predict(region_t id, int mprotect_flags) {
+	table::State &state = table::state(id);
+	if (mprotect_flags != PROT_READ || !gWritePrediction || state.writes == 0) {
+		return mprotect_flags;
+	}
+
+	mark(id, true);
+	state.predicted = true;
+	add(local().write_predictions);
+	return mprotect_flags | PROT_WRITE;
+}
 
-	addr = mmap(nullptr, size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+/*! \brief Notes contents of a region just filled writable by prediction */
+static void predicted(region_t id) {
+	gPredictions[id % kPredictions] = {id, checksum(table::address(id), table::size(id))};
+}
 
-	if (addr == MAP_FAILED) {
-		throw std::runtime_error("fsalloc: mmap failed");
+/*! \brief Carries checksum of a predicted region over to 'moved', holding the same contents followed by zeros */
+static void repredict(region_t id, region_t moved, uint32_t old_size) {
+	Prediction &prediction = gPredictions[id % kPredictions];
+	if (prediction.id != id) {
+		return;
+	}
+
+	// Summing a zero word only multiplies the sum by the prime
+	uint64_t sum = prediction.sum;
+	for (size_t i = sizealign(old_size); i < sizealign(table::size(moved)); i += sizeof(uint64_t)) {
+		sum *= 0x100000001b3ULL;
 	}
+	prediction.id = table::kNone;
+	gPredictions[moved % kPredictions] = {moved, sum};
+}
 
-	gAllocations[addr] = Info::emptyInfo(size);
+/*! \brief Settles prediction of a region leaving cache, adjusting likelihood of its next write */
+static void settle(region_t id, table::State &state) {
+	if (!state.predicted) {
+		state.writes = state.written ? kMaxWriteLikelihood : 0;
+		return;
+	}
 
-	gStats.allocs++;
+	// Predicted regions take no write fault, so it is their contents that tell whether they were written
+	Prediction &prediction = gPredictions[id % kPredictions];
+	bool known = prediction.id == id;
+	bool written = state.written || (known && prediction.sum != checksum(table::address(id), table::size(id)));
+	prediction.id = table::kNone;
+	if (written) {
+		state.writes = kMaxWriteLikelihood;
+		return;
+	}
+
+	// Predictions decay, so that a region which is not known to be written is verified every few residencies
+	state.writes--;
+	if (known) {
+		add(local().speculative_writebacks);
+	}
+}
+
+/*! \brief Removes 'count' oldest regions from cache other than 'keep', writing dirty ones back in a single batch */
+static void evict(size_t count, region_t keep = table::kNone) {
+	assert(gRegionCache.size >= count);
+	FSALLOC_PHASE(evict);
+
+	while (count-- > 0) {
+		//Remove page from cache
+		region_t id = dequeue();
+		table::State &state = table::state(id);
+
+		if (id == keep || (gPolicy == Policy::clock && state.referenced)) {
+			// Every region passed loses its mark, so the hand stops within one revolution
+			state.referenced = false;
+			enqueue(id);
+			count++;
+			continue;
+		}
+
+		void *addr = table::address(id);
+		uint32_t size = table::size(id);
+		add(local().resident_bytes, -static_cast<unsigned long long>(sizealign(size)));
+		trace::record(trace::Event::evict, addr, size);
+		FSALLOC_PROBE3(evict, addr, size, state.dirty);
+		sites::evicted(addr);
+		mrc::evicted(addr);
+		state.cached = false;
+		state.readahead = false;
+
+		// Regions written during residency are predicted to be written again
+		settle(id, state);
+		state.written = false;
+		state.predicted = false;
+
+		if (!state.dirty) {
+			forget(addr, size);
+			add(local().clean_evictions);
+			continue;
+		}
+
+		// Write page to db - dirty region is always at least readable
+		mark(id, false);
+		add(local().dirty_evictions);
+		if (rewritable(id)) {
+			batch(id, addr, size, false);
+			continue;
+		}
+		store(id);
+
+		// Drop page frames and reprotect
+		forget(addr, size);
+		add(local().writebacks);
+	}
+
+	storeBatch(false);
+}
+
+void fsalloc::writeback() {
+	Guard guard(gLock);
+	evict(std::min<size_t>(gRegionCache.size, 1));
+}
+
+/*! \brief Writes oldest dirty regions to database, keeping them resident, until at most 'target' are dirty */
+static void clean(size_t target) {
+	for (region_t id = gRegionCache.head; id != table::kNone && gDirty > target; id = table::link(id)) {
+		if (!table::state(id).dirty) {
+			continue;
+		}
+
+		// Region stays resident, but the next write has to mark it dirty again
+		void *addr = table::address(id);
+		uint32_t size = table::size(id);
+		protect(addr, size, PROT_READ);
+		mark(id, false);
+		if (rewritable(id)) {
+			batch(id, addr, size, true);
+		} else {
+			store(id);
+			add(local().writebacks);
+		}
+	}
+
+	storeBatch(true);
+}
+
+void fsalloc::flush() {
+	Guard guard(gLock);
+	clean(0);
+}
+
+void fsalloc::sync() {
+	Guard guard(gLock);
+	clean(0);
+	db::sync();
+}
+
+/*! \brief Starts flusher if too many cached regions are dirty */
+static void watermark() {
+	if (gHighWatermark > 0 && gDirty > gHighWatermark * gRegionCacheCapacity) {
+		clean(gLowWatermark * gRegionCacheCapacity);
+	}
+}
+
+/*! \brief Inserts region to cache, performing a batch of writebacks if limit is reached - never evicting
+ * the region itself, which is about to be accessed by the faulting instruction
+ */
+static void cacheRegion(region_t id) {
+	enqueue(id);
+	add(local().resident_bytes, sizealign(table::size(id)));
+
+	if (gRegionCache.size > gRegionCacheCapacity) {
+		size_t batch = std::min<size_t>(std::max<size_t>(gRegionCacheCapacity / 8, 1), kWritebackBatch);
+		evict(std::min(gRegionCache.size - 1, gRegionCache.size - gRegionCacheCapacity + batch - 1), id);
+	}
+}
+
+region_t fsalloc::find(void *addr) {
+	FSALLOC_PHASE(lookup);
+	return table::find(addr);
+}
+
+bool fsalloc::allocated(region_t region) {
+	return region != table::kNone;
+}
+
+void *fsalloc::fsalloc(uint32_t size, Residency residency) {
+	bool resident = residency == Residency::resident;
+	sites::attach();
+	Guard guard(gLock);
+
+	region_t id = table::create(size);
+	void *addr = table::address(id);
+	trace::record(trace::Event::alloc, addr, size, resident ? trace::kResident : 0);
+	FSALLOC_PROBE3(alloc, addr, size, resident);
+	sites::allocated(addr);
+	if (resident) {
+		// Region has no copy in database yet, so it starts dirty
+		protect(addr, size, PROT_READ | PROT_WRITE);
+		mark(id, true);
+		table::state(id).cached = true;
+		cacheRegion(id);
+		watermark();
+	}
+
+	add(local().allocs);
 	return addr;
 }
 
 void fsalloc::fsfree(void *addr) {
-	int ret;
-	auto it = find(addr);
-	if (allocated(it)) {
-		Info &info = it->second;
+	Guard guard(gLock);
+	region_t id = at(addr);
+	if (allocated(id)) {
+		uint32_t size = table::size(id);
+		trace::record(trace::Event::free, addr, size);
+		FSALLOC_PROBE2(free, addr, size);
+		sites::freed(addr);
+
+		if (table::stored(id)) {
+			db::del(table::handle(id));
+		}
+		mark(id, false);
+		if (table::state(id).cached) {
+			unlink(id);
+			add(local().resident_bytes, -static_cast<unsigned long long>(sizealign(size)));
+		}
 
-		db::del(info.rid);
+		// Slot is handed out again, so it must not keep any page frames
+		forget(addr, size);
+		table::destroy(id);
+	}
 
-		ret = munmap(addr, sizealign(info.size));
-		if (ret < 0) {
-			throw std::runtime_error("fsalloc: munmap failed");
+	add(local().frees);
+}
+
+/*! \brief Gives access to pages a cached region grew by, matching protection of the rest of it */
+static void extend(region_t id, uint32_t old_size) {
+	const table::State &state = table::state(id);
+	uint32_t size = table::size(id);
+	if (!state.cached || sizealign(size) <= sizealign(old_size)) {
+		return;
+	}
+
+	// Marker regions stay inaccessible, like the fresh pages
+	if (!state.readahead) {
+		char *tail = reinterpret_cast<char *>(table::address(id)) + sizealign(old_size);
+		protect(tail, sizealign(size) - sizealign(old_size), state.dirty ? PROT_READ | PROT_WRITE : PROT_READ);
+	}
+	add(local().resident_bytes, sizealign(size) - sizealign(old_size));
+}
+
+/*! \brief Resizes region within its slot */
+static void resizeInPlace(region_t id, uint32_t size) {
+	char *addr = reinterpret_cast<char *>(table::address(id));
+	uint32_t old_size = table::size(id);
+	bool dirty = table::state(id).dirty;
+
+	// Dirty bytes are counted for the old size and then for the new one
+	mark(id, false);
+	table::size(id) = size;
+	mark(id, dirty);
+
+	if (sizealign(size) < sizealign(old_size)) {
+		// Pages past the end of a region are kept fresh and inaccessible
+		forget(addr + sizealign(size), sizealign(old_size) - sizealign(size));
+		if (table::state(id).cached) {
+			add(local().resident_bytes, -static_cast<unsigned long long>(sizealign(old_size) - sizealign(size)));
+		}
+	}
+	extend(id, old_size);
+}
+
+/*! \brief Moves region to a larger slot, carrying its page frames, database record and entries of tables
+ * keyed by its address or id along
+ */
+static region_t move(region_t id, uint32_t size) {
+	void *addr = table::address(id);
+	uint32_t old_size = table::size(id);
+	region_t moved = table::create(size);
+	void *target = table::address(moved);
+	table::State state = table::state(id);
+
+	if (state.cached) {
+		// Page frames are moved, not copied - the old slot is left with fresh inaccessible pages
+		try {
+			relocate(reinterpret_cast<char *>(addr), reinterpret_cast<char *>(target), old_size);
+		} catch (...) {
+			// Region keeps its slot, the new one is handed back with fresh inaccessible pages
+			forget(target, old_size);
+			table::destroy(moved);
+			throw;
+		}
+		forget(addr, old_size);
+		unlink(id);
+	}
+	mark(id, false);
+	if (table::stored(id)) {
+		// Record is resized lazily, on the next writeback of the region
+		db::handle_t rid = table::handle(id);
+		table::unstore(id);
+		table::handle(moved, rid);
+	}
+	repredict(id, moved, old_size);
+	sites::moved(addr, target);
+	mrc::moved(addr, target);
+	table::destroy(id);
+
+	bool dirty = state.dirty;
+	state.dirty = false;
+	table::state(moved) = state;
+	mark(moved, dirty);
+	if (state.cached) {
+		enqueue(moved);
+	}
+	extend(moved, old_size);
+	return moved;
+}
+
+void *fsalloc::fsrealloc(void *addr, uint32_t size) {
+	if (!addr) {
+		return fsalloc(size);
+	}
+	if (size == 0) {
+		fsfree(addr);
+		return nullptr;
+	}
+
+	Guard guard(gLock);
+	region_t id = at(addr);
+	if (!allocated(id)) {
+		throw std::runtime_error("fsalloc: realloc of unknown region");
+	}
+
+	uint32_t old_size = table::size(id);
+	trace::record(trace::Event::free, addr, old_size);
+	FSALLOC_PROBE2(free, addr, old_size);
+	if (table::fits(id, size)) {
+		resizeInPlace(id, size);
+	} else {
+		id = move(id, size);
+		addr = table::address(id);
+	}
+	// Region replayed from the trace starts resident if it stays cached
+	bool resident = table::state(id).cached;
+	trace::record(trace::Event::alloc, addr, size, resident ? trace::kResident : 0);
+	FSALLOC_PROBE3(alloc, addr, size, resident);
+	return addr;
+}
+
+/*! \brief Fills region with its contents from db (or extracts a never-used page) and caches it */
+static void fill(region_t id, int mprotect_flags) {
+	void *region = table::address(id);
+	uint32_t size = table::size(id);
+	table::State &state = table::state(id);
+	bool stored = table::stored(id);
+
+	if (stored && gTransplant && sizealign(size) <= kStagingSize) {
+		// Contents are prepared aside and replace the region in one go,
+		// already protected according to its access type
+		char *pages = stage(size);
+		fetch(table::handle(id), pages, size);
+		if (mprotect_flags != (PROT_READ | PROT_WRITE)) {
+			protect(pages, size, mprotect_flags);
 		}
+		transplant(pages, region, size);
+	} else {
+		if (stored) {
+			// Page needs to be read and written to be filled with data
+			protect(region, size, PROT_READ | PROT_WRITE);
+			fetch(table::handle(id), region, size);
+		}
+
+		// Region is now protected according to its access type
+		protect(region, size, mprotect_flags);
+	}
+
+	state.cached = true;
+	cacheRegion(id);
+}
+
+/*! \brief Loads a stored region ahead of its use, returns true iff it was loaded
+ * The marker region is left inaccessible, so that touching it continues the stream.
+ */
+static bool prefetch(void *region, bool marker, uint32_t max_size = std::numeric_limits<uint32_t>::max()) {
+	region_t id = at(region);
+	if (!allocated(id)) {
+		return false;
+	}
 
-		gAllocations.erase(it);
+	table::State &state = table::state(id);
+	if (state.cached || !table::stored(id) || table::size(id) > max_size) {
+		return false;
 	}
 
-	gStats.frees++;
+	state.readahead = marker;
+	fill(id, marker ? PROT_NONE : PROT_READ);
+	return true;
+}
+
+/*! \brief Returns address of region stored at given position in storage, or nullptr */
+static void *storedAt(intptr_t pos) {
+	region_t id = table::at(pos);
+	return allocated(id) ? table::address(id) : nullptr;
+}
+
+/*! \brief Advances a stream with a fault at 'pos' and reads ahead if the stream is sequential
+ * \param successor returns the position following given one, or 0 if stream ends there
+ * \param region    returns the region placed at given position
+ */
+template<typename Successor, typename Region>
+static void advance(Stream &stream, intptr_t pos, Successor successor, Region region) {
+	// Both streams together may take at most half of the cache
+	uint32_t limit = std::min(gReadaheadMax, gRegionCacheCapacity / 4);
+
+	if (pos == stream.marker) {
+		// Region read ahead was touched - keep the stream going with a larger window
+		stream.window = std::min(stream.window * 2, limit);
+	} else {
+		if (pos == successor(stream.last)) {
+			stream.window = std::min(kInitialReadahead, limit);
+			stream.next = successor(pos);
+		} else {
+			stream.window = 0;
+		}
+		stream.stride = pos - stream.last;
+	}
+	stream.last = pos;
+	stream.marker = 0;
+
+	// The first region of every window marks the spot to issue the next one,
+	// so that upcoming regions are loaded before the stream reaches them
+	for (uint32_t i = 0; i < stream.window && stream.next != 0; ++i) {
+		if (i == 0) {
+			stream.marker = stream.next;
+		}
+		if (prefetch(region(stream.next), i == 0)) {
+			add(local().readaheads);
+		}
+		stream.next = successor(stream.next);
+	}
+}
+
+/*! \brief Feeds a fault on a stored region to sequential access detection */
+static void sequential(region_t id) {
+	if (gReadaheadMax == 0) {
+		return;
+	}
+
+	advance(gAddressStream, reinterpret_cast<intptr_t>(table::address(id)),
+		[](intptr_t pos) {
+			intptr_t next = pos + gAddressStream.stride;
+			return gAddressStream.stride != 0 && allocated(at(reinterpret_cast<void *>(next))) ? next : 0;
+		},
+		[](intptr_t pos) {
+			return reinterpret_cast<void *>(pos);
+		});
+
+	advance(gHandleStream, table::position(table::handle(id)), table::next, storedAt);
+}
+
+/*! \brief Loads small non-resident neighbours of a small faulting region, read-only */
+static void around(region_t id) {
+	uint32_t limit = std::min(2 * gFaultAround, gRegionCacheCapacity / 4);
+	uint32_t loaded = 0;
+
+	if (gFaultAround == 0 || table::size(id) > static_cast<uint32_t>(kPagesize)) {
+		return;
+	}
+
+	auto load = [&loaded](void *neighbour) {
+		if (prefetch(neighbour, false, kPagesize)) {
+			loaded++;
+		}
+	};
+
+	if (gLocality == Locality::address) {
+		char *base = static_cast<char *>(table::address(id));
+		for (uint32_t i = 1; i <= gFaultAround && loaded < limit; ++i) {
+			load(base - i * kPagesize);
+			load(base + i * kPagesize);
+		}
+	} else if (table::stored(id)) {
+		intptr_t lower = table::position(table::handle(id)), upper = lower;
+		for (uint32_t i = 0; i < gFaultAround && loaded < limit; ++i) {
+			if (lower != 0 && (lower = table::prev(lower)) != 0) {
+				load(storedAt(lower));
+			}
+			if (upper != 0 && (upper = table::next(upper)) != 0) {
+				load(storedAt(upper));
+			}
+		}
+	}
+
+	add(local().faultarounds, loaded);
+}
+
+/*! \brief Changes capacity of region cache, evicting regions above the new limit */
+static void resize(uint32_t capacity) {
+	// Region just faulted in must stay, or the access faults again forever
+	capacity = std::max(capacity, 1u);
+	gRegionCacheCapacity = capacity;
+	if (gRegionCache.size > capacity) {
+		evict(gRegionCache.size - capacity);
+	}
+}
+
+/*! \brief Resizes cache according to the curve estimated in last epoch
+ * The curve does not reach below the current capacity, so the cache is shrunk
+ * step by step while the fault rate stays well under target.
+ */
+static void tune() {
+	const mrc::Curve &curve = mrc::curve();
+
+	if (gTargetRate <= 0 || curve.count == 0) {
+		return;
+	}
+
+	uint32_t capacity = gRegionCacheCapacity;
+	if (curve.points[0].rate < gTargetRate / 2) {
+		capacity -= capacity / 8;
+	} else {
+		// Smallest estimated capacity meeting the target, or the largest one if none does
+		for (uint32_t i = 0; i < curve.count; ++i) {
+			capacity = curve.points[i].capacity;
+			if (curve.points[i].rate <= gTargetRate) {
+				break;
+			}
+		}
+	}
+
+	resize(std::max(kMinCapacity, std::min(capacity, gBudget)));
+}
+
+/*! \brief Puts back the handler installed before fsalloc's, which the faulting instruction restarts under -
+ * with the default one, it crashes with SIGSEGV as it would without fsalloc
+ */
+static void decline() {
+	sigaction(SIGSEGV, &default_sigsegv, nullptr);
 }
 
 /*! \brief SIGSEGV signal handler */
-static void handler(int sig, siginfo_t *si, void *ctx) {
-	void *region;
-	char *tmp;
+static void handler(int, siginfo_t *si, void *ctx) {
 	int mprotect_flags;
+	unsigned long long syscalls = gSyscalls;
+	unsigned long long start = now();
+	FSALLOC_PHASE(fault);
+	FSALLOC_PROBE2(fault__entry, si->si_addr, (get_mprotect_flags(ctx) & PROT_WRITE) != 0);
+	// Faults outside the arena are not ours - checked before locking,
+	// so that a crash in code holding the lock is not turned into a deadlock
+	if (!table::owns(si->si_addr)) {
+		decline();
+		return;
+	}
+
+	bool handled;
+	{
+		Guard guard(gLock);
+		tFaulting = true;
+
+		// Any page of a region leads to it, not only the first one
+		region_t id = find(si->si_addr);
+		handled = allocated(id);
+		if (handled) {
+			void *region = table::address(id);
+			uint32_t size = table::size(id);
+			table::State &state = table::state(id);
+			mprotect_flags = get_mprotect_flags(ctx);
+			trace::record(mprotect_flags & PROT_WRITE ? trace::Event::write_fault : trace::Event::read_fault,
+					region, size);
+			Stats &stats = local();
+			unsigned long long fetched = stats.bytes_fetched;
+			unsigned long long evictions = stats.clean_evictions + stats.dirty_evictions;
+			add(mprotect_flags & PROT_WRITE ? stats.write_faults : stats.read_faults);
+			if (mprotect_flags & PROT_WRITE) {
+				mark(id, true);
+				state.written = true;
+				if (state.cached && !state.readahead) {
+					add(stats.write_upgrades);
+				}
+			}
+
+			if (state.heat < std::numeric_limits<decltype(state.heat)>::max()) {
+				state.heat++;
+			}
+
+			if (state.cached) {
+				add(stats.cache_hits);
+				state.referenced = true;
+				// Region is resident - it was either written to or read ahead
+				protect(region, size, mprotect_flags);
+				if (state.readahead) {
+					state.readahead = false;
+					sequential(id);
+				}
+			} else {
+				if (table::stored(id)) {
+					mrc::fetched(region);
+				} else {
+					add(stats.zero_fills);
+				}
+				mprotect_flags = predict(id, mprotect_flags);
+				fill(id, mprotect_flags);
+				if (table::state(id).predicted) {
+					predicted(id);
+				}
+				if (table::stored(id)) {
+					sequential(id);
+				}
+				around(id);
+				if (mrc::tick(gRegionCacheCapacity)) {
+					tune();
+				}
+			}
+			watermark();
 
-	region = pagealign(si->si_addr);
-	auto it = find(region);
-	if (allocated(it)) {
-		Info &info = it->second;
-		if (!verify(region, si->si_addr, info.size)) {
-			default_sigsegv.sa_handler(sig);
-		}
-		mprotect_flags = get_mprotect_flags(ctx);
-		if (mprotect_flags & PROT_WRITE) {
-			info.dirty = true;
-			if (info.cached) {
-				protect(region, info.size, mprotect_flags);
-				return;
+			if (sites::enabled()) {
+				uintptr_t pc, fp;
+				get_frame(ctx, pc, fp);
+				sites::faulted(region, pc, fp, stats.bytes_fetched - fetched,
+						stats.clean_evictions + stats.dirty_evictions - evictions);
 			}
+
+			add(stats.faults);
+			add(stats.fault_syscalls, gSyscalls - syscalls);
+			unsigned long long elapsed = now() - start;
+			sample(stats.fault_latency, elapsed);
+			FSALLOC_PROBE3(fault__return, region, size, elapsed);
+
 		}
+		tFaulting = false;
+	}
 
-		// Filling with contents from db (or extracting a never-used-page)
-		if (info.valid()) {
-			// Page needs to be read and written to be filled with data
-			protect(region, info.size, PROT_READ | PROT_WRITE);
-			tmp = db::get(info.rid);
-			memcpy(region, tmp, info.size);
+	// Address within the arena, but of no region - a genuine crash, reported once the lock is released
+	if (!handled) {
+		decline();
+	}
+}
+
+/*! \brief Drops all regions, as database is truncated on initialization */
+static void reset() {
+	table::reset();
+	gRegionCache = {table::kNone, table::kNone, 0};
+	gAddressStream = Stream();
+	gHandleStream = Stream();
+	gDirty = 0;
+	std::fill(std::begin(gPredictions), std::end(gPredictions), Prediction{table::kNone, 0});
+	mrc::reset();
+}
+
+void fsalloc::readahead(uint32_t max_window) {
+	Guard guard(gLock);
+	gReadaheadMax = max_window;
+}
+
+void fsalloc::faultaround(uint32_t window, Locality locality) {
+	Guard guard(gLock);
+	gFaultAround = window;
+	gLocality = locality;
+}
+
+void fsalloc::writeprediction(bool enable) {
+	Guard guard(gLock);
+	gWritePrediction = enable;
+}
+
+void fsalloc::transplant(bool enable) {
+	Guard guard(gLock);
+	gTransplant = enable;
+}
+
+void fsalloc::capacity(uint32_t capacity) {
+	Guard guard(gLock);
+	resize(capacity);
+}
+
+void fsalloc::policy(Policy policy) {
+	Guard guard(gLock);
+	gPolicy = policy;
+}
+
+void fsalloc::watermarks(double low, double high) {
+	Guard guard(gLock);
+	gLowWatermark = std::min(low, high);
+	gHighWatermark = high;
+}
+
+/*! \brief Gathers information on a region from its metadata */
+static Info info(region_t id) {
+	const table::State &state = table::state(id);
+	Info info = Info::emptyInfo(table::size(id));
+
+	info.rid = table::handle(id);
+	info.dirty = state.dirty;
+	info.cached = state.cached;
+	info.readahead = state.readahead;
+	info.written = state.written;
+	info.predicted = state.predicted;
+	info.writes = state.writes;
+	info.referenced = state.referenced;
+	info.heat = state.heat;
+	return info;
+}
+
+std::vector<Region> fsalloc::hottest(size_t count) {
+	std::vector<Region> regions;
+	auto hotter = [](const Region &a, const Region &b) { return a.info.heat > b.info.heat; };
+	Guard guard(gLock);
+
+	// Min-heap of hottest regions seen so far
+	table::each([&](region_t id) {
+		unsigned heat = table::state(id).heat;
+		if (heat == 0) {
+			return;
+		}
+		if (regions.size() < count) {
+			regions.push_back({table::address(id), info(id)});
+			std::push_heap(regions.begin(), regions.end(), hotter);
+		} else if (count > 0 && heat > regions.front().info.heat) {
+			std::pop_heap(regions.begin(), regions.end(), hotter);
+			regions.back() = {table::address(id), info(id)};
+			std::push_heap(regions.begin(), regions.end(), hotter);
 		}
+	});
 
-		info.cached = true;
-		cacheRegion(region);
+	std::sort_heap(regions.begin(), regions.end(), hotter);
+	return regions;
+}
 
-		// Region is now protected according to its access type
-		protect(region, info.size, mprotect_flags);
-	} else {
-		default_sigsegv.sa_handler(sig);
-	}
+std::vector<Region> fsalloc::regions() {
+	std::vector<Region> regions;
+	Guard guard(gLock);
+
+	regions.reserve(table::count());
+	table::each([&regions](region_t id) {
+		regions.push_back({table::address(id), info(id)});
+	});
+	return regions;
+}
+
+Occupancy fsalloc::occupancy() {
+	Guard guard(gLock);
+	table::Usage metadata = table::usage();
+	return {gRegionCacheCapacity, gRegionCache.size, gDirty, table::count(),
+			metadata.capacity, metadata.resident, metadata.chunks, metadata.spilled};
+}
+
+void fsalloc::metadata(uint32_t chunks) {
+	Guard guard(gLock);
+	table::capacity(chunks);
+}
+
+std::vector<db::handle_t> fsalloc::metadataRecords() {
+	Guard guard(gLock);
+	return table::records();
+}
+
+std::vector<db::sizeclass_t> fsalloc::storeClasses() {
+	Guard guard(gLock);
+	return db::classes();
 }
 
-void fsalloc::init(const std::string &path, uint32_t capacity) {
+void fsalloc::scanStore(const std::function<void(const std::vector<db::sizeclass_t> &classes)> &start,
+		const std::function<void(const db::handle_t &rid, uint32_t size)> &visit) {
+	Guard guard(gLock);
+	start(db::classes());
+	db::scan(visit);
+}
+
+void fsalloc::autotune(double target_rate, uint32_t budget) {
+	Guard guard(gLock);
+	gTargetRate = target_rate;
+	gBudget = budget;
+}
+
+mrc::Curve fsalloc::curve() {
+	Guard guard(gLock);
+	return mrc::curve();
+}
+
+void fsalloc::sampling(uint32_t every) {
+	Guard guard(gLock);
+	sites::sampling(every);
+}
+
+void fsalloc::profile(FILE *out, sites::Profile profile, sites::Metric metric) {
+	Guard guard(gLock);
+	sites::dump(out, profile, metric);
+}
+
+void fsalloc::startTrace(const std::string &path, size_t buffer) {
+	Guard guard(gLock);
+	trace::start(path, buffer);
+}
+
+void fsalloc::stopTrace() {
+	Guard guard(gLock);
+	trace::stop();
+}
+
+void fsalloc::init(const std::string &path, uint32_t capacity, const Options &options) {
 	struct sigaction sa;
 
 	sa.sa_flags = SA_SIGINFO;
@@ -191,16 +1316,38 @@ void fsalloc::init(const std::string &path, uint32_t capacity) {
 		throw std::runtime_error("fsalloc: sigaction failed");
 	}
 
-	gRegionCacheCapacity = capacity;
-	gStats = Stats();
+	// Threads may first show up in a fault handler, which must not create keys
+	pthread_once(&gShardOnce, [] {
+		pthread_key_create(&gShardKey, [](void *shard) { static_cast<Shard *>(shard)->busy = false; });
+	});
 
-	db::init(path, kPagesize, 1024, 1);
+	sites::attach();
+	Guard guard(gLock);
+	reset();
+	phase::reset();
+	gRegionCacheCapacity = std::max(capacity, 1u);
+	for (Shard *shard = gShards; shard != nullptr; shard = shard->next) {
+		shard->stats = Stats();
+	}
+
+	db::init(path, options);
 }
 
 void fsalloc::term() {
+	Guard guard(gLock);
+	trace::stop();
 	db::term();
 }
 
-const Stats &stats() {
-	return gStats;
+Stats fsalloc::stats() {
+	Stats total = Stats();
+	auto sum = reinterpret_cast<unsigned long long *>(&total);
+
+	for (Shard *shard = gShards; shard != nullptr; shard = shard->next) {
+		auto counters = reinterpret_cast<unsigned long long *>(&shard->stats);
+		for (size_t i = 0; i < sizeof(Stats) / sizeof(unsigned long long); ++i) {
+			sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+		}
+	}
+	return total;
 }
@@ -14,6 +14,7 @@
  *   void *x = fsalloc(2 * sizeof(int));
  *   void *y = fsalloc<int>();
  *   Class z = fsnew<Class>(custom, constructor, parameters);
+ *   x = fsrealloc(x, 4 * sizeof(int));
  *   fsfree(x);
  *   fsfree(y);
  *   fsdelete(z);
@@ -48,24 +49,35 @@
 #pragma once
 
 #include "fsalloc/db_wrapper.h"
+#include "fsalloc/mrc.h"
+#include "fsalloc/sites.h"
+#include "fsalloc/table.h"
+#include "fsalloc/trace.h"
 #include <cstdarg>
 #include <cstring>
-#include <deque>
+#include <functional>
 #include <limits>
 #include <string>
-#include <unordered_map>
+#include <vector>
+#include <unistd.h>
 
 namespace fsalloc {
 
-/*! \brief Represents information on single allocation */
+/*! \brief Represents information on single allocation, as gathered from its metadata (see table.h) */
 struct Info {
 	db::handle_t rid; /*!< key for BerkeleyDB heap database entry */
 	uint32_t size;	/*!< size of allocated region */
 	bool dirty : 1;   /*!< true iff region is dirty (its current state is different than in database) */
 	bool cached : 1;  /*!< true iff region is cached in RAM */
+	bool readahead : 1; /*!< true iff region was read ahead and marks the spot to continue a stream */
+	bool written : 1; /*!< true iff a write fault hit region during its current residency */
+	bool predicted : 1; /*!< true iff region was installed writable in anticipation of a write */
+	unsigned writes : 2; /*!< likelihood of region being written during its next residency */
+	bool referenced : 1; /*!< true iff region faulted while resident since it was last passed by clock policy */
+	uint16_t heat;    /*!< number of faults on region, saturating */
 
 	static Info emptyInfo(uint32_t s) {
-		return {invalid_handle, s, false, false};
+		return {invalid_handle, s, false, false, false, false, false, 0, false, 0};
 	}
 
 	bool valid() {
@@ -75,21 +87,94 @@ struct Info {
 	static const db::handle_t invalid_handle;
 };
 
-/*! \brief Represents global fsalloc statistics */
+static const int kHistogramBuckets = 40;
+
+/*! \brief Latency histogram - bucket 'i' counts samples of [2^i, 2^(i+1)) nanoseconds */
+struct Histogram {
+	unsigned long long buckets[kHistogramBuckets];
+	unsigned long long count; /*!< number of samples */
+	unsigned long long total; /*!< sum of all samples, in nanoseconds */
+
+	/*! \brief Returns upper bound of the bucket holding given percentile (0..1) of samples, in nanoseconds */
+	unsigned long long percentile(double p) const;
+};
+
+/*! \brief Represents global fsalloc statistics
+ * Counters are gathered per thread and summed when read.
+ * Faults which find their region already resident (touching a region read ahead,
+ * upgrading read access to write) count as cache hits, everything else has to be
+ * fetched from database or zero-filled.
+ */
 struct Stats {
 	unsigned long long allocs;
 	unsigned long long frees;
+	unsigned long long faults;
+	unsigned long long read_faults;
+	unsigned long long write_faults;
 	unsigned long long cache_hits;
+	unsigned long long write_upgrades;
+	unsigned long long zero_fills;
+	unsigned long long clean_evictions;
+	unsigned long long dirty_evictions;
 	unsigned long long writebacks;
+	unsigned long long readaheads;
+	unsigned long long faultarounds;
+	unsigned long long write_predictions;
+	unsigned long long speculative_writebacks; /*!< writebacks of regions installed writable which were not written */
+	unsigned long long fault_syscalls;
+	unsigned long long bytes_fetched;  /*!< bytes read from database */
+	unsigned long long bytes_written;  /*!< bytes written to database */
+	unsigned long long resident_bytes; /*!< bytes of regions currently cached */
+	unsigned long long dirty_bytes;    /*!< bytes of regions currently dirty */
+	Histogram fault_latency;           /*!< time spent in fault handler */
+	Histogram get_latency;             /*!< time of single database reads */
+	Histogram put_latency;             /*!< time of database writes, a batch counts as one */
+};
+
+/*! \brief Residency of a freshly allocated region */
+enum class Residency {
+	lazy,    /*!< region is inaccessible until its first touch faults it in */
+	resident /*!< region enters cache resident, writable and dirty */
+};
+
+/*! \brief Locality used to pick neighbours loaded together with a faulting region */
+enum class Locality {
+	address, /*!< neighbouring pages in address space */
+	storage  /*!< neighbouring records in database */
+};
+
+/*! \brief Order in which regions are evicted from cache */
+enum class Policy {
+	fifo, /*!< oldest region first */
+	clock /*!< oldest region first, but regions which faulted while resident get a second chance */
+};
+
+/*! \brief Region along with its information, as returned by hottest() */
+struct Region {
+	void *addr;
+	Info info;
 };
 
-/* \brief keeps information about every allocated region */
-typedef std::unordered_map<void *, Info> AllocMap;
-/* \brief keeps a queue of regions active in RAM */
-typedef std::deque<void *> RegionCache;
+/*! \brief Usage of region cache */
+struct Occupancy {
+	uint32_t capacity; /*!< max number of cached regions */
+	size_t cached;     /*!< number of cached regions */
+	size_t dirty;      /*!< number of dirty regions */
+	size_t allocated;  /*!< number of allocated regions */
+	uint32_t metadata_capacity; /*!< max number of metadata chunks kept in RAM */
+	uint32_t metadata_resident; /*!< number of metadata chunks in RAM */
+	uint64_t metadata_chunks;   /*!< number of metadata chunks */
+	uint64_t metadata_spilled;  /*!< number of metadata chunks with a copy in database */
+};
 
 static const int kPagesize = getpagesize();
 static const int kDefaultCapacity = 0x100000;
+static const int kDefaultReadahead = 32;
+
+/*! \brief Reports a failed system or storage call - throws, unless a fault is being handled,
+ * which can neither go on nor unwind, so the reason is written to stderr and the process aborts
+ */
+[[noreturn]] void fail(const char *what, int err);
 
 inline void debug(const char* format, ...) {
 #ifndef NDEBUG
@@ -114,24 +199,117 @@ inline uint32_t sizealign(uint32_t size) {
 	return ((size + kPagesize - 1) / kPagesize) * kPagesize;
 }
 
-/*! \brief Returns an iterator to allocated region or AllocMap::end if not found */
-AllocMap::iterator find(void *addr);
+/*! \brief Returns allocated region which given address falls into, or table::kNone if not found */
+table::region_t find(void *addr);
 
-bool allocated(const AllocMap::iterator &it);
+bool allocated(table::region_t region);
 
 /*! \brief Allocates 'size' bytes */
-void *fsalloc(uint32_t size);
+void *fsalloc(uint32_t size, Residency residency = Residency::lazy);
 
 /*! \brief Explicitly frees allocated region */
 void fsfree(void *addr);
 
+/*! \brief Resizes allocated region to 'size' bytes, returns its possibly new address
+ * Region is resized in place if its slot is large enough, otherwise its page frames are moved
+ * with mremap() - pages which are not resident are neither read nor written.
+ * Null 'addr' allocates a new region, size 0 frees it and returns null.
+ */
+void *fsrealloc(void *addr, uint32_t size);
+
 /*! \brief Performs a writeback to database */
 void writeback();
 
+/*! \brief Writes all dirty regions to database, keeping them resident */
+void flush();
+
+/*! \brief Writes all dirty regions to database like flush(), then syncs database files to disk */
+void sync();
+
+/*! \brief Sets maximal number of regions read ahead for a sequential stream, 0 disables readahead */
+void readahead(uint32_t max_window);
+
+/*! \brief Sets fault-around window - number of neighbours on each side of a small faulting region
+ * which are loaded along with it, 0 disables fault-around
+ */
+void faultaround(uint32_t window, Locality locality = Locality::address);
+
+/*! \brief Enables installing regions written during their recent residencies as writable and dirty,
+ * which saves a second fault on read-then-write access at the cost of speculative writebacks
+ */
+void writeprediction(bool enable);
+
+/*! \brief Enables filling regions in a staging buffer which is then transplanted with a single mremap() */
+void transplant(bool enable);
+
+/*! \brief Changes capacity of region cache, evicting regions above the new limit */
+void capacity(uint32_t capacity);
+
+/*! \brief Sets eviction policy of region cache */
+void policy(Policy policy);
+
+/*! \brief Sets flusher watermarks, as fractions of cache capacity - once more than 'high' regions
+ * are dirty, oldest dirty regions are written back (staying resident) until at most 'low' are left
+ * High watermark of 0 disables the flusher.
+ */
+void watermarks(double low, double high);
+
+/*! \brief Returns up to 'count' regions which faulted most often, hottest first */
+std::vector<Region> hottest(size_t count);
+
+/*! \brief Returns all allocated regions */
+std::vector<Region> regions();
+
+/*! \brief Returns usage of region cache */
+Occupancy occupancy();
+
+/*! \brief Sets number of metadata chunks kept in RAM, each describing up to 2^table::kChunkShift
+ * regions of a single class - others are spilled to database and read back on use
+ */
+void metadata(uint32_t chunks);
+
+/*! \brief Returns database records holding spilled metadata chunks */
+std::vector<db::handle_t> metadataRecords();
+
+/*! \brief Returns databases of every size class, see db::classes() */
+std::vector<db::sizeclass_t> storeClasses();
+
+/*! \brief Calls 'start' with databases of every size class and then 'visit' with every record in database,
+ * see db::classes() and db::scan()
+ * Both run under a single lock, so every record visited belongs to a class passed to 'start'. Writebacks wait
+ * until the scan is done, so neither may touch regions.
+ */
+void scanStore(const std::function<void(const std::vector<db::sizeclass_t> &classes)> &start,
+		const std::function<void(const db::handle_t &rid, uint32_t size)> &visit);
+
+/*! \brief Enables resizing region cache after every estimation epoch, so that the estimated
+ * fault rate stays at 'target_rate' faults per second with as few regions as possible
+ * \param budget max capacity the cache may grow to
+ * Target rate of 0 disables autotuning.
+ */
+void autotune(double target_rate, uint32_t budget);
+
+/*! \brief Returns miss ratio curve estimated from sampled refaults, see mrc.h */
+mrc::Curve curve();
+
+/*! \brief Samples every 'every'-th fault and allocation for call site profiles, see sites.h
+ * Sampling of 0 disables it and drops gathered stacks.
+ */
+void sampling(uint32_t every);
+
+/*! \brief Writes a call site profile in folded stack format, see sites.h */
+void profile(FILE *out, sites::Profile profile, sites::Metric metric);
+
+/*! \brief Starts recording events to file at 'path', see trace.h */
+void startTrace(const std::string &path, size_t buffer = trace::kDefaultBuffer);
+
+/*! \brief Flushes buffered events and stops recording, see trace.h */
+void stopTrace();
+
 /*! \brief Allocates new T object */
 template<typename T>
-T *fsalloc() {
-	return static_cast<T *>(fsalloc(sizeof(T)));
+T *fsalloc(Residency residency = Residency::lazy) {
+	return static_cast<T *>(fsalloc(sizeof(T), residency));
 }
 
 /*! \brief Frees T object allocated with fsalloc */
@@ -142,8 +320,9 @@ void fsfree(T *addr) {
 
 template<typename T, typename... Args>
 T *fsnew(Args&&... args) {
-	T *addr = fsalloc::fsalloc<T>();
-	return new (addr) T(args...);
+	// Object is constructed right away, so there is no point in faulting it in
+	T *addr = fsalloc::fsalloc<T>(Residency::resident);
+	return ::new (addr) T(args...);
 }
 
 template<typename T, typename... Args>
@@ -152,15 +331,18 @@ void fsdelete(T *obj) {
 	return fsfree<T>(obj);
 }
 
+/*! \brief Storage backend tuning, passed to init() */
+using db::Options;
+
 /*! \brief Performs initialization steps for fsalloc module */
-void init(const std::string &path, uint32_t capacity = kDefaultCapacity);
+void init(const std::string &path, uint32_t capacity = kDefaultCapacity, const Options &options = Options());
 
 
 /*! \brief Terminates fsalloc module */
 void term();
 
-/*! \brief Returns structure with global fsalloc statistics */
-const Stats &stats();
+/*! \brief Returns global fsalloc statistics, summed over all threads */
+Stats stats();
 
 /*! \brief Base structure for classes managed by fsalloc
  * Inheriting from this structure overloads memory management
@@ -168,7 +350,7 @@ const Stats &stats();
  */
 struct managed {
 	void *operator new(std::size_t size) {
-		return fsalloc::fsalloc(size);
+		return fsalloc::fsalloc(size, Residency::resident);
 	}
 
 	void operator delete(void *obj) noexcept {
@@ -0,0 +1,271 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "fsalloc/fsalloc.h"
+
+/*
+ * Benchmarks take cache capacity and storage backend as their last two arguments -
+ * those which never cache a region take the backend alone.
+ * Results are compared between releases in machine-readable form:
+ *   fsalloc_benchmark --benchmark_format=json --benchmark_out=results.json
+ */
+
+static const char *kPath = "/tmp/fsalloc_benchmark.bdb";
+static const int kRegions = 4096;
+
+/* \brief Regions touched to push other regions out of cache */
+static std::vector<char *> gFillers;
+
+/*! \brief Describes a storage backend configuration */
+struct Backend {
+	const char *name;
+	fsalloc::Options options;
+};
+
+static std::vector<Backend> backends() {
+	std::vector<Backend> backends(3);
+
+	backends[0].name = "default";
+
+	backends[1].name = "small-mpool";
+	backends[1].options.mpool_size = 1024 * 1024;
+
+	backends[2].name = "locked-logged";
+	backends[2].options.single_writer = false;
+	backends[2].options.logging = true;
+
+	return backends;
+}
+
+/*! \brief Initializes fsalloc with given capacity and the backend taken from benchmark argument 'backend_arg' */
+static void setup(benchmark::State &state, uint32_t capacity, int backend_arg) {
+	Backend backend = backends().at(state.range(backend_arg));
+
+	fsalloc::init(kPath, capacity, backend.options);
+	gFillers.clear();
+	// Every access should be measured on its own
+	fsalloc::readahead(0);
+	fsalloc::faultaround(0);
+	fsalloc::writeprediction(false);
+	state.SetLabel(backend.name);
+}
+
+/*! \brief Initializes fsalloc with capacity and backend taken from benchmark arguments */
+static void setup(benchmark::State &state, int capacity_arg) {
+	setup(state, state.range(capacity_arg), capacity_arg + 1);
+}
+
+/*! \brief Pushes every region out of cache by writing to 'capacity' filler regions */
+static void evictAll(int64_t capacity) {
+	if (gFillers.empty()) {
+		for (int64_t i = 0; i < capacity; ++i) {
+			gFillers.push_back(static_cast<char *>(fsalloc::fsalloc(1, fsalloc::Residency::resident)));
+		}
+	}
+	for (char *filler : gFillers) {
+		*filler = 0;
+	}
+}
+
+/*! \brief Allocates regions and writes them to storage */
+static std::vector<char *> populate(int64_t capacity, uint32_t size = sizeof(long)) {
+	std::vector<char *> regions(kRegions);
+	for (auto &region : regions) {
+		region = static_cast<char *>(fsalloc::fsalloc(size));
+		*region = 1;
+	}
+	evictAll(capacity);
+	return regions;
+}
+
+static void BackendOnly(benchmark::internal::Benchmark *b, std::vector<int64_t> head) {
+	for (size_t backend = 0; backend < backends().size(); ++backend) {
+		std::vector<int64_t> args(head);
+		args.push_back(backend);
+		b->Args(args);
+	}
+}
+
+static void CapacityAndBackend(benchmark::internal::Benchmark *b, std::vector<int64_t> head) {
+	for (int64_t capacity : {64, 1024}) {
+		std::vector<int64_t> args(head);
+		args.push_back(capacity);
+		BackendOnly(b, args);
+	}
+}
+
+static void BM_AllocFree(benchmark::State &state) {
+	setup(state, fsalloc::kDefaultCapacity, 1);
+	uint32_t size = state.range(0);
+
+	for (auto _ : state) {
+		void *region = fsalloc::fsalloc(size);
+		fsalloc::fsfree(region);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AllocFree)
+	->ArgNames({"size", "backend"})
+	->Apply([](benchmark::internal::Benchmark *b) {
+		for (int64_t size : {8, 4096, 64 * 1024, 1024 * 1024}) {
+			BackendOnly(b, {size});
+		}
+	});
+
+static void BM_ColdFault(benchmark::State &state) {
+	setup(state, 0);
+	std::vector<char *> regions = populate(state.range(0));
+	size_t next = 0;
+	long sum = 0;
+
+	for (auto _ : state) {
+		if (next == regions.size()) {
+			state.PauseTiming();
+			evictAll(state.range(0));
+			next = 0;
+			state.ResumeTiming();
+		}
+		sum += *regions[next++];
+	}
+	benchmark::DoNotOptimize(sum);
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ColdFault)
+	->ArgNames({"capacity", "backend"})
+	->Apply([](benchmark::internal::Benchmark *b) { CapacityAndBackend(b, {}); });
+
+static void BM_WarmHit(benchmark::State &state) {
+	setup(state, 0);
+	std::vector<char *> regions = populate(state.range(0));
+	size_t resident = std::min<size_t>(state.range(0) / 2, regions.size());
+	size_t next = 0;
+	long sum = 0;
+
+	for (size_t i = 0; i < resident; ++i) {
+		sum += *regions[i];
+	}
+	for (auto _ : state) {
+		sum += *regions[next];
+		next = next + 1 == resident ? 0 : next + 1;
+	}
+	benchmark::DoNotOptimize(sum);
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_WarmHit)
+	->ArgNames({"capacity", "backend"})
+	->Apply([](benchmark::internal::Benchmark *b) { CapacityAndBackend(b, {}); });
+
+static void BM_ReadToWriteUpgrade(benchmark::State &state) {
+	setup(state, 0);
+	std::vector<char *> regions = populate(state.range(0));
+	size_t resident = std::min<size_t>(state.range(0) / 2, regions.size());
+	size_t next = resident;
+	long sum = 0;
+
+	for (auto _ : state) {
+		if (next == resident) {
+			// Fault regions in for reading, so that each write below upgrades access
+			state.PauseTiming();
+			evictAll(state.range(0));
+			for (size_t i = 0; i < resident; ++i) {
+				sum += *regions[i];
+			}
+			next = 0;
+			state.ResumeTiming();
+		}
+		*regions[next++] = 2;
+	}
+	benchmark::DoNotOptimize(sum);
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ReadToWriteUpgrade)
+	->ArgNames({"capacity", "backend"})
+	->Apply([](benchmark::internal::Benchmark *b) { CapacityAndBackend(b, {}); });
+
+static void BM_Eviction(benchmark::State &state) {
+	setup(state, 1);
+	bool dirty = state.range(0);
+	std::vector<char *> regions = populate(state.range(1));
+	size_t resident = std::min<size_t>(state.range(1), regions.size());
+	size_t next = resident;
+	long sum = 0;
+
+	for (auto _ : state) {
+		if (next == resident) {
+			// Fill whole cache with clean or dirty regions
+			state.PauseTiming();
+			evictAll(state.range(1));
+			for (size_t i = 0; i < resident; ++i) {
+				if (dirty) {
+					*regions[i] = 3;
+				} else {
+					sum += *regions[i];
+				}
+			}
+			next = 0;
+			state.ResumeTiming();
+		}
+		fsalloc::writeback();
+		next++;
+	}
+	benchmark::DoNotOptimize(sum);
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Eviction)
+	->ArgNames({"dirty", "capacity", "backend"})
+	->Apply([](benchmark::internal::Benchmark *b) {
+		CapacityAndBackend(b, {0});
+		CapacityAndBackend(b, {1});
+	});
+
+static void BM_DbGet(benchmark::State &state) {
+	setup(state, fsalloc::kDefaultCapacity, 1);
+	uint32_t size = state.range(0);
+	std::vector<char> buffer(size);
+	std::vector<fsalloc::db::handle_t> handles(kRegions);
+	size_t next = 0;
+
+	for (auto &handle : handles) {
+		handle = fsalloc::db::put(buffer.data(), size);
+	}
+	for (auto _ : state) {
+		fsalloc::db::get(handles[next], buffer.data(), size);
+		next = next + 1 == handles.size() ? 0 : next + 1;
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_DbGet)
+	->ArgNames({"size", "backend"})
+	->Apply([](benchmark::internal::Benchmark *b) {
+		for (int64_t size : {8, 4096, 64 * 1024}) {
+			BackendOnly(b, {size});
+		}
+	});
+
+static void BM_DbPut(benchmark::State &state) {
+	setup(state, fsalloc::kDefaultCapacity, 1);
+	uint32_t size = state.range(0);
+	std::vector<char> buffer(size);
+	std::vector<fsalloc::db::handle_t> handles(kRegions);
+	size_t next = 0;
+
+	for (auto &handle : handles) {
+		handle = fsalloc::db::put(buffer.data(), size);
+	}
+	for (auto _ : state) {
+		fsalloc::db::put(buffer.data(), size, handles[next]);
+		next = next + 1 == handles.size() ? 0 : next + 1;
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_DbPut)
+	->ArgNames({"size", "backend"})
+	->Apply([](benchmark::internal::Benchmark *b) {
+		for (int64_t size : {8, 4096, 64 * 1024}) {
+			BackendOnly(b, {size});
+		}
+	});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,61 @@
+/*
+ * fsalloc_inspect - reports how the backing store of an fsalloc heap is used
+ *
+ * Opens the store read-only and scans every record of every size class.
+ * Given an allocation map written by fsalloc::inspect::dump() at the same
+ * moment, records are split into live and dead ones and pages are shaded by
+ * how often their regions fault, which tells whether compacting the store
+ * or changing its geometry would pay off.
+ *
+ * Usage:
+ *   fsalloc_inspect [-m map] [-w width] [-c mpool_size] store
+ */
+
+#include "fsalloc/fsalloc.h"
+#include "fsalloc/inspect.h"
+
+#include <getopt.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+
+using namespace fsalloc;
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-m map] [-w width] [-c mpool_size] store\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	std::string map;
+	unsigned width = 64;
+	Options options;
+	int opt;
+
+	options.readonly = true;
+	while ((opt = getopt(argc, argv, "m:w:c:")) != -1) {
+		switch (opt) {
+		case 'm': map = optarg; break;
+		case 'w': width = strtoul(optarg, nullptr, 10); break;
+		case 'c': options.mpool_size = strtoull(optarg, nullptr, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc || width == 0) {
+		usage(argv[0]);
+	}
+
+	try {
+		db::init(argv[optind], options);
+		inspect::Report report = map.empty()
+				? inspect::analyze({}, false)
+				: inspect::analyze(inspect::load(map));
+		inspect::print(stdout, report, width);
+		db::term();
+	} catch (const std::exception &e) {
+		fprintf(stderr, "%s: %s\n", argv[0], e.what());
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * fsalloc_replay - drives a recorded trace against a fresh fsalloc heap
+ *
+ * Allocations, frees and faults of the trace are issued in order against
+ * a heap configured from the command line, so that capacity, eviction
+ * policy, prediction and backend changes can be compared on production
+ * access patterns.
+ * Evictions recorded in the trace are only counted, for comparison.
+ *
+ * Usage:
+ *   fsalloc_replay [-c capacity] [-p path] [-r readahead] [-f faultaround]
+ *                  [-e fifo|clock] [-w on|off] [-x on|off] [-m mpool_size] [-t] trace
+ *   -e sets eviction policy, fifo by default
+ *   -w turns write prediction on or off, on by default
+ *   -x turns filling through staging pages (transplant) on or off, on by default
+ *   -t replays with original timing instead of as fast as possible
+ *
+ * When built with FSALLOC_PHASE_TIMING, a breakdown of fault handling time
+ * follows the summary.
+ */
+
+#include "fsalloc/fsalloc.h"
+#include "fsalloc/phase.h"
+#include "fsalloc/trace.h"
+
+#include <getopt.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+using namespace fsalloc;
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-c capacity] [-p path] [-r readahead] [-f faultaround] [-e fifo|clock] "
+			"[-w on|off] [-x on|off] [-m mpool_size] [-t] trace\n", name);
+	exit(EXIT_FAILURE);
+}
+
+/*! \brief Parses "on" or "off", exiting with usage otherwise */
+static bool toggle(const char *name, const std::string &word) {
+	if (word != "on" && word != "off") {
+		usage(name);
+	}
+	return word == "on";
+}
+
+int main(int argc, char **argv) {
+	uint32_t capacity = kDefaultCapacity;
+	std::string path = "/tmp/fsalloc_replay.bdb";
+	uint32_t readahead = kDefaultReadahead;
+	uint32_t faultaround = 0;
+	Policy policy = Policy::fifo;
+	bool writeprediction = true;
+	bool transplant = true;
+	bool timed = false;
+	Options options;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:p:r:f:e:w:x:m:t")) != -1) {
+		switch (opt) {
+		case 'c': capacity = strtoul(optarg, nullptr, 10); break;
+		case 'p': path = optarg; break;
+		case 'r': readahead = strtoul(optarg, nullptr, 10); break;
+		case 'f': faultaround = strtoul(optarg, nullptr, 10); break;
+		case 'e':
+			if (strcmp(optarg, "fifo") != 0 && strcmp(optarg, "clock") != 0) {
+				usage(argv[0]);
+			}
+			policy = strcmp(optarg, "fifo") == 0 ? Policy::fifo : Policy::clock;
+			break;
+		case 'w': writeprediction = toggle(argv[0], optarg); break;
+		case 'x': transplant = toggle(argv[0], optarg); break;
+		case 'm': options.mpool_size = strtoull(optarg, nullptr, 10); break;
+		case 't': timed = true; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+	}
+
+	std::vector<trace::Record> records = trace::load(argv[optind]);
+	std::unordered_map<uint64_t, char *> regions;
+	unsigned long long evictions = 0, skipped = 0;
+	volatile char sink;
+
+	init(path, capacity, options);
+	fsalloc::readahead(readahead);
+	fsalloc::faultaround(faultaround);
+	fsalloc::policy(policy);
+	fsalloc::writeprediction(writeprediction);
+	fsalloc::transplant(transplant);
+
+	auto start = std::chrono::steady_clock::now();
+	for (const auto &record : records) {
+		if (timed) {
+			std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.timestamp));
+		}
+
+		auto it = regions.find(record.region);
+		switch (record.event) {
+		case trace::Event::alloc:
+			regions[record.region] = static_cast<char *>(fsalloc::fsalloc(record.size,
+					record.flags & trace::kResident ? Residency::resident : Residency::lazy));
+			break;
+		case trace::Event::free:
+			if (it != regions.end()) {
+				fsfree(it->second);
+				regions.erase(it);
+			}
+			break;
+		case trace::Event::read_fault:
+			if (it != regions.end()) {
+				sink = *it->second;
+			} else {
+				skipped++;
+			}
+			break;
+		case trace::Event::write_fault:
+			if (it != regions.end()) {
+				*it->second = 0;
+			} else {
+				skipped++;
+			}
+			break;
+		case trace::Event::evict:
+			evictions++;
+			break;
+		}
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	(void)sink;
+
+	Stats s = stats();
+	printf("events: %zu\n", records.size());
+	printf("elapsed_sec: %.3f\n", elapsed);
+	printf("faults: %llu\n", s.faults);
+	printf("writebacks: %llu\n", s.writebacks);
+	printf("evictions: %llu\n", s.clean_evictions + s.dirty_evictions);
+	printf("traced_evictions: %llu\n", evictions);
+	printf("readaheads: %llu\n", s.readaheads);
+	printf("faultarounds: %llu\n", s.faultarounds);
+	printf("write_predictions: %llu\n", s.write_predictions);
+	printf("speculative_writebacks: %llu\n", s.speculative_writebacks);
+	printf("fault_syscalls: %llu\n", s.fault_syscalls);
+	printf("bytes_fetched: %llu\n", s.bytes_fetched);
+	printf("bytes_written: %llu\n", s.bytes_written);
+	printf("fault_ns_p50: %llu\n", s.fault_latency.percentile(0.50));
+	printf("fault_ns_p99: %llu\n", s.fault_latency.percentile(0.99));
+	printf("skipped: %llu\n", skipped);
+	if (phase::kEnabled) {
+		phase::dump(stdout);
+	}
+
+	term();
+	return 0;
+}
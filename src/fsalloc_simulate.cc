@@ -0,0 +1,487 @@
+/*
+ * fsalloc_simulate - offline region cache simulator driven by recorded traces
+ *
+ * Replays accesses of a trace recorded with fsalloc::trace against several
+ * eviction policies and a sweep of cache capacities, without mapping any
+ * memory or touching storage. For every policy and capacity it prints the
+ * miss ratio and bytes which would be written back, as CSV:
+ *   policy,capacity,accesses,misses,miss_ratio,writeback_bytes
+ *
+ * Policies:
+ *   fifo  - insertion order, as fsalloc RegionCache
+ *   lru   - least recently used
+ *   clock - second chance
+ *   arc   - adaptive replacement cache (Megiddo, Modha)
+ *   opt   - Belady's optimal, the lower bound for any policy
+ *
+ * Traces hold faults only - touches of resident regions never reach fsalloc.
+ * Recording with a small cache captures more of the real access stream.
+ *
+ * Usage:
+ *   fsalloc_simulate [-p fifo,lru,clock,arc,opt] [-c min:max] [-s steps] trace
+ */
+
+#include "fsalloc/trace.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <list>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace fsalloc;
+
+namespace {
+
+/*! \brief Single access of the simulated stream */
+struct Access {
+	uint64_t id;   /*!< region id, unique for the whole trace */
+	uint32_t size;
+	bool write;
+	bool free;     /*!< region is freed instead of accessed */
+};
+
+/*! \brief Eviction policy of simulated cache */
+class Policy {
+public:
+	explicit Policy(size_t capacity) : capacity_(capacity) {}
+	virtual ~Policy() {}
+
+	/*! \brief Accesses region, returns true on hit; on miss region is inserted
+	 * and 'evicted' is set to a region pushed out to make room, or 0
+	 */
+	virtual bool access(uint64_t id, uint64_t &evicted) = 0;
+
+	/*! \brief Drops a freed region, if cached */
+	virtual void remove(uint64_t id) = 0;
+
+protected:
+	size_t capacity_;
+};
+
+/*! \brief Ordered list with O(1) lookup, used as a building block of policies */
+class Queue {
+public:
+	bool contains(uint64_t id) const {
+		return index_.count(id) > 0;
+	}
+
+	size_t size() const {
+		return list_.size();
+	}
+
+	void push(uint64_t id) {
+		list_.push_back(id);
+		index_[id] = std::prev(list_.end());
+	}
+
+	uint64_t pop() {
+		uint64_t id = list_.front();
+		list_.pop_front();
+		index_.erase(id);
+		return id;
+	}
+
+	bool erase(uint64_t id) {
+		auto it = index_.find(id);
+		if (it == index_.end()) {
+			return false;
+		}
+		list_.erase(it->second);
+		index_.erase(it);
+		return true;
+	}
+
+private:
+	std::list<uint64_t> list_;
+	std::unordered_map<uint64_t, std::list<uint64_t>::iterator> index_;
+};
+
+class Fifo : public Policy {
+public:
+	using Policy::Policy;
+
+	bool access(uint64_t id, uint64_t &evicted) override {
+		evicted = 0;
+		if (queue_.contains(id)) {
+			return true;
+		}
+		queue_.push(id);
+		if (queue_.size() > capacity_) {
+			evicted = queue_.pop();
+		}
+		return false;
+	}
+
+	void remove(uint64_t id) override {
+		queue_.erase(id);
+	}
+
+private:
+	Queue queue_;
+};
+
+class Lru : public Policy {
+public:
+	using Policy::Policy;
+
+	bool access(uint64_t id, uint64_t &evicted) override {
+		evicted = 0;
+		bool hit = queue_.erase(id);
+		queue_.push(id);
+		if (!hit && queue_.size() > capacity_) {
+			evicted = queue_.pop();
+		}
+		return hit;
+	}
+
+	void remove(uint64_t id) override {
+		queue_.erase(id);
+	}
+
+private:
+	Queue queue_;
+};
+
+class Clock : public Policy {
+public:
+	explicit Clock(size_t capacity) : Policy(capacity), hand_(0) {}
+
+	bool access(uint64_t id, uint64_t &evicted) override {
+		evicted = 0;
+		auto it = index_.find(id);
+		if (it != index_.end()) {
+			slots_[it->second].referenced = true;
+			return true;
+		}
+
+		if (!free_.empty()) {
+			place(free_.back(), id);
+			free_.pop_back();
+		} else if (slots_.size() < capacity_) {
+			slots_.push_back(Slot());
+			place(slots_.size() - 1, id);
+		} else {
+			// Give referenced regions a second chance
+			while (slots_[hand_].referenced) {
+				slots_[hand_].referenced = false;
+				hand_ = (hand_ + 1) % slots_.size();
+			}
+			evicted = slots_[hand_].id;
+			index_.erase(evicted);
+			place(hand_, id);
+			hand_ = (hand_ + 1) % slots_.size();
+		}
+		return false;
+	}
+
+	void remove(uint64_t id) override {
+		auto it = index_.find(id);
+		if (it == index_.end()) {
+			return;
+		}
+		// Freed slot is reused before the hand evicts anything
+		slots_[it->second] = Slot();
+		free_.push_back(it->second);
+		index_.erase(it);
+	}
+
+private:
+	struct Slot {
+		uint64_t id = 0;
+		bool referenced = false;
+	};
+
+	void place(size_t slot, uint64_t id) {
+		slots_[slot].id = id;
+		slots_[slot].referenced = false;
+		index_[id] = slot;
+	}
+
+	std::vector<Slot> slots_;
+	std::vector<size_t> free_;
+	std::unordered_map<uint64_t, size_t> index_;
+	size_t hand_;
+};
+
+class Arc : public Policy {
+public:
+	explicit Arc(size_t capacity) : Policy(capacity), p_(0) {}
+
+	bool access(uint64_t id, uint64_t &evicted) override {
+		evicted = 0;
+
+		if (t1_.erase(id) || t2_.erase(id)) {
+			t2_.push(id);
+			return true;
+		}
+
+		if (b1_.contains(id)) {
+			// Recency list was too short
+			p_ = std::min<double>(capacity_, p_ + std::max<double>(1.0, double(b2_.size()) / b1_.size()));
+			replace(false, evicted);
+			b1_.erase(id);
+			t2_.push(id);
+			return false;
+		}
+
+		if (b2_.contains(id)) {
+			// Frequency list was too short
+			p_ = std::max<double>(0, p_ - std::max<double>(1.0, double(b1_.size()) / b2_.size()));
+			replace(true, evicted);
+			b2_.erase(id);
+			t2_.push(id);
+			return false;
+		}
+
+		if (t1_.size() + b1_.size() == capacity_) {
+			if (t1_.size() < capacity_) {
+				b1_.pop();
+				replace(false, evicted);
+			} else {
+				evicted = t1_.pop();
+			}
+		} else if (t1_.size() + b1_.size() < capacity_) {
+			size_t total = t1_.size() + t2_.size() + b1_.size() + b2_.size();
+			if (total >= capacity_) {
+				if (total == 2 * capacity_) {
+					b2_.pop();
+				}
+				replace(false, evicted);
+			}
+		}
+		t1_.push(id);
+		return false;
+	}
+
+	void remove(uint64_t id) override {
+		t1_.erase(id) || t2_.erase(id) || b1_.erase(id) || b2_.erase(id);
+	}
+
+private:
+	void replace(bool in_b2, uint64_t &evicted) {
+		if (t1_.size() > 0 && (t1_.size() > p_ || (in_b2 && t1_.size() == static_cast<size_t>(p_)))) {
+			evicted = t1_.pop();
+			b1_.push(evicted);
+		} else if (t2_.size() > 0) {
+			evicted = t2_.pop();
+			b2_.push(evicted);
+		}
+	}
+
+	Queue t1_, t2_, b1_, b2_;
+	double p_;
+};
+
+class Opt : public Policy {
+public:
+	/*! \brief 'next' holds, for every access, position of the next access to the same region */
+	Opt(size_t capacity, const std::vector<size_t> &next) : Policy(capacity), next_(next), position_(0) {}
+
+	bool access(uint64_t id, uint64_t &evicted) override {
+		size_t next = next_[position_++];
+		evicted = 0;
+
+		auto it = cached_.find(id);
+		bool hit = it != cached_.end();
+		if (hit) {
+			byNext_.erase({it->second, id});
+		} else if (cached_.size() == capacity_) {
+			// Evict region reused furthest in the future
+			auto victim = std::prev(byNext_.end());
+			evicted = victim->second;
+			cached_.erase(evicted);
+			byNext_.erase(victim);
+		}
+		cached_[id] = next;
+		byNext_.insert({next, id});
+		return hit;
+	}
+
+	void remove(uint64_t id) override {
+		position_++;
+		auto it = cached_.find(id);
+		if (it != cached_.end()) {
+			byNext_.erase({it->second, id});
+			cached_.erase(it);
+		}
+	}
+
+private:
+	const std::vector<size_t> &next_;
+	size_t position_;
+	std::unordered_map<uint64_t, size_t> cached_;
+	std::set<std::pair<size_t, uint64_t>> byNext_;
+};
+
+/*! \brief Outcome of a simulation */
+struct Result {
+	unsigned long long accesses;
+	unsigned long long misses;
+	unsigned long long writeback_bytes;
+};
+
+/*! \brief Converts trace to accesses, renaming regions so that reused addresses get new ids */
+std::vector<Access> accesses(const std::vector<trace::Record> &records) {
+	std::vector<Access> accesses;
+	std::unordered_map<uint64_t, uint64_t> live;
+	uint64_t ids = 0;
+
+	for (const auto &record : records) {
+		switch (record.event) {
+		case trace::Event::alloc:
+			live[record.region] = ++ids;
+			if (record.flags & trace::kResident) {
+				accesses.push_back({ids, record.size, true, false});
+			}
+			break;
+		case trace::Event::free:
+			if (live.count(record.region)) {
+				accesses.push_back({live[record.region], record.size, false, true});
+				live.erase(record.region);
+			}
+			break;
+		case trace::Event::read_fault:
+		case trace::Event::write_fault:
+			if (!live.count(record.region)) {
+				// Region allocated before tracing started
+				live[record.region] = ++ids;
+			}
+			accesses.push_back({live[record.region], record.size, record.event == trace::Event::write_fault, false});
+			break;
+		case trace::Event::evict:
+			break;
+		}
+	}
+	return accesses;
+}
+
+/*! \brief Returns, for every access, position of the next access to the same region */
+std::vector<size_t> nextUses(const std::vector<Access> &accesses) {
+	std::vector<size_t> next(accesses.size());
+	std::unordered_map<uint64_t, size_t> seen;
+
+	for (size_t i = accesses.size(); i-- > 0;) {
+		auto it = seen.find(accesses[i].id);
+		// Freed regions are never used again
+		bool last = accesses[i].free || it == seen.end() || accesses[it->second].free;
+		next[i] = last ? std::numeric_limits<size_t>::max() : it->second;
+		seen[accesses[i].id] = i;
+	}
+	return next;
+}
+
+Result simulate(Policy &policy, const std::vector<Access> &accesses) {
+	Result result = {0, 0, 0};
+	std::unordered_map<uint64_t, uint32_t> dirty;
+
+	for (const auto &access : accesses) {
+		uint64_t evicted;
+
+		if (access.free) {
+			policy.remove(access.id);
+			dirty.erase(access.id);
+			continue;
+		}
+
+		result.accesses++;
+		if (!policy.access(access.id, evicted)) {
+			result.misses++;
+		}
+		if (access.write) {
+			dirty[access.id] = access.size;
+		}
+		if (evicted) {
+			auto it = dirty.find(evicted);
+			if (it != dirty.end()) {
+				result.writeback_bytes += it->second;
+				dirty.erase(it);
+			}
+		}
+	}
+	return result;
+}
+
+std::unique_ptr<Policy> policy(const std::string &name, size_t capacity, const std::vector<size_t> &next) {
+	if (name == "fifo") {
+		return std::unique_ptr<Policy>(new Fifo(capacity));
+	} else if (name == "lru") {
+		return std::unique_ptr<Policy>(new Lru(capacity));
+	} else if (name == "clock") {
+		return std::unique_ptr<Policy>(new Clock(capacity));
+	} else if (name == "arc") {
+		return std::unique_ptr<Policy>(new Arc(capacity));
+	} else if (name == "opt") {
+		return std::unique_ptr<Policy>(new Opt(capacity, next));
+	}
+	throw std::invalid_argument("unknown policy: " + name);
+}
+
+void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-p fifo,lru,clock,arc,opt] [-c min:max] [-s steps] trace\n", name);
+	exit(EXIT_FAILURE);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+	std::string policies = "fifo,lru,clock,arc,opt";
+	size_t min = 16, max = 1 << 20;
+	unsigned steps = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:c:s:")) != -1) {
+		switch (opt) {
+		case 'p': policies = optarg; break;
+		case 'c':
+			if (sscanf(optarg, "%zu:%zu", &min, &max) != 2 || min == 0 || max < min) {
+				usage(argv[0]);
+			}
+			break;
+		case 's': steps = strtoul(optarg, nullptr, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+	}
+
+	std::vector<Access> stream = accesses(trace::load(argv[optind]));
+	std::vector<size_t> next = nextUses(stream);
+
+	// Capacities are spread geometrically, by default one per power of two
+	std::vector<size_t> capacities;
+	if (steps == 0) {
+		steps = std::log2(static_cast<double>(max) / min) + 1;
+	}
+	for (unsigned i = 0; i < steps; ++i) {
+		size_t capacity = steps == 1 ? min : std::llround(min * std::pow(static_cast<double>(max) / min, double(i) / (steps - 1)));
+		if (capacities.empty() || capacities.back() != capacity) {
+			capacities.push_back(capacity);
+		}
+	}
+
+	printf("policy,capacity,accesses,misses,miss_ratio,writeback_bytes\n");
+	std::stringstream names(policies);
+	std::string name;
+	while (std::getline(names, name, ',')) {
+		for (size_t capacity : capacities) {
+			auto p = policy(name, capacity, next);
+			Result result = simulate(*p, stream);
+			printf("%s,%zu,%llu,%llu,%.6f,%llu\n", name.c_str(), capacity, result.accesses, result.misses,
+					result.accesses ? static_cast<double>(result.misses) / result.accesses : 0.0,
+					result.writeback_bytes);
+		}
+	}
+	return 0;
+}
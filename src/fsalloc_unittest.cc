@@ -1,9 +1,26 @@
 #include <gtest/gtest.h>
 
+#include <limits.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <array>
+#include <sstream>
+#include <thread>
 #include <vector>
 
+#include "fsalloc/admin.h"
 #include "fsalloc/fsalloc.h"
+#include "fsalloc/inspect.h"
+#include "fsalloc/phase.h"
+#include "fsalloc/pool.h"
+#include "fsalloc/sites.h"
+#include "fsalloc/trace.h"
 
 TEST(Fsalloc, MultiAlloc) {
 	fsalloc::init("/tmp/fsalloc.bdb", 2);
@@ -66,3 +83,935 @@ TEST(Fsalloc, BasicAlloc) {
 	fsalloc::fsfree<char>(dummy);
 	fsalloc::fsfree<char>(buffer);
 }
+
+TEST(Fsalloc, SequentialScan) {
+	fsalloc::init("/tmp/fsalloc.bdb", 16);
+
+	std::array<int *, 256> arr;
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		arr[i] = fsalloc::fsalloc<int>();
+		*arr[i] = i * 3;
+	}
+
+	// Scan forth and back, so that regions are streamed from database
+	fsalloc::Stats before = fsalloc::stats();
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		EXPECT_EQ(3 * i, *arr[i]);
+	}
+	fsalloc::Stats stats = fsalloc::stats();
+	EXPECT_LT(stats.faults - before.faults, arr.size() / 2);
+	EXPECT_GT(stats.readaheads, before.readaheads);
+
+	before = stats;
+	for (unsigned i = arr.size(); i-- > 0;) {
+		EXPECT_EQ(3 * i, *arr[i]);
+	}
+	stats = fsalloc::stats();
+	EXPECT_LT(stats.faults - before.faults, arr.size() / 2);
+	EXPECT_GT(stats.readaheads, before.readaheads);
+
+	for (unsigned i = arr.size(); i-- > 0;) {
+		*arr[i] += 1;
+	}
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		EXPECT_EQ(3 * i + 1, *arr[i]);
+	}
+}
+
+TEST(Fsalloc, FaultAround) {
+	const unsigned kGroups = 25;
+
+	for (auto locality : {fsalloc::Locality::address, fsalloc::Locality::storage}) {
+		fsalloc::init("/tmp/fsalloc.bdb", 32);
+		fsalloc::readahead(0);
+		fsalloc::faultaround(2, locality);
+
+		std::array<long *, 5 * kGroups> arr;
+		for (unsigned i = 0; i < arr.size(); ++i) {
+			arr[i] = fsalloc::fsalloc<long>();
+			*arr[i] = i;
+		}
+
+		// Touch the middle of every group of neighbours first, groups out of order,
+		// so that only fault-around brings the rest of a group in
+		fsalloc::Stats before = fsalloc::stats();
+		for (unsigned k = 0; k < kGroups; ++k) {
+			unsigned first = k * 7 % kGroups * 5;
+			EXPECT_EQ(first + 2, *arr[first + 2]);
+			for (unsigned i = first; i < first + 5; ++i) {
+				EXPECT_EQ(i, *arr[i]);
+			}
+		}
+		fsalloc::Stats stats = fsalloc::stats();
+		EXPECT_LE(stats.faults - before.faults, kGroups);
+		EXPECT_GT(stats.faultarounds, before.faultarounds);
+
+		for (unsigned i = 0; i < arr.size(); ++i) {
+			*arr[i] = -*arr[i];
+		}
+		for (unsigned i = 0; i < arr.size(); ++i) {
+			EXPECT_EQ(-static_cast<long>(i), *arr[i]);
+		}
+	}
+	fsalloc::faultaround(0);
+	fsalloc::readahead(fsalloc::kDefaultReadahead);
+}
+
+TEST(Fsalloc, LargeRegion) {
+	const uint32_t kSize = 5 * fsalloc::kPagesize + 10;
+
+	fsalloc::init("/tmp/fsalloc.bdb", 4);
+
+	// Any page of a region may be touched first
+	char *large = static_cast<char *>(fsalloc::fsalloc(kSize));
+	large[kSize - 1] = 'z';
+	large[0] = 'a';
+	EXPECT_EQ(large, reinterpret_cast<char *>(fsalloc::regions().front().addr));
+	EXPECT_TRUE(fsalloc::table::owns(large + kSize - 1));
+	EXPECT_FALSE(fsalloc::table::owns(&kSize));
+	for (unsigned i = 0; i < 8; ++i) {
+		*fsalloc::fsalloc<char>() = 'x';
+	}
+	EXPECT_EQ('z', large[kSize - 1]);
+	EXPECT_EQ('a', large[0]);
+
+	// Slots of freed regions are handed out again
+	fsalloc::fsfree(large);
+	EXPECT_EQ(large, fsalloc::fsalloc(kSize));
+	EXPECT_EQ(9u, fsalloc::occupancy().allocated);
+}
+
+TEST(Fsalloc, HugeRegion) {
+	const uint32_t kSize = (1u << fsalloc::table::kSpanShift) * fsalloc::kPagesize + 10;
+
+	fsalloc::init("/tmp/fsalloc.bdb", 4);
+
+	// Regions larger than a span cover several spans, their pages past the first span fault in too
+	char *huge = static_cast<char *>(fsalloc::fsalloc(kSize));
+	huge[kSize - 1] = 'z';
+	huge[0] = 'a';
+	EXPECT_EQ('z', huge[kSize - 1]);
+	EXPECT_EQ(fsalloc::find(huge), fsalloc::find(huge + kSize - 1));
+
+	char *grown = static_cast<char *>(fsalloc::fsrealloc(fsalloc::fsalloc(10), kSize));
+	grown[kSize - 1] = 'y';
+	EXPECT_EQ('y', grown[kSize - 1]);
+}
+
+TEST(Fsalloc, MixedSizes) {
+	const std::array<int, 6> kSizes = {{
+		sizeof(int), 1000, fsalloc::kPagesize - 100, fsalloc::kPagesize, 3 * fsalloc::kPagesize + 5, 10 * fsalloc::kPagesize,
+	}};
+
+	fsalloc::init("/tmp/fsalloc.bdb", 2);
+
+	std::vector<char *> regions;
+	for (unsigned round = 0; round < 4; ++round) {
+		for (int size : kSizes) {
+			char *region = static_cast<char *>(fsalloc::fsalloc(size));
+			for (int i = 0; i < size; ++i) {
+				region[i] = static_cast<char>(i * 7 + regions.size());
+			}
+			regions.push_back(region);
+		}
+	}
+
+	// Regions are read back whole straight into their pages, whichever class holds their records
+	for (unsigned pass = 0; pass < 2; ++pass) {
+		fsalloc::Stats before = fsalloc::stats();
+		for (unsigned r = 0; r < regions.size(); ++r) {
+			int size = kSizes[r % kSizes.size()];
+			for (int i = 0; i < size; ++i) {
+				ASSERT_EQ(static_cast<char>(i * 7 + r + pass), regions[r][i]) << "region " << r << ", byte " << i;
+			}
+			for (int i = 0; i < size; ++i) {
+				regions[r][i] = static_cast<char>(i * 7 + r + pass + 1);
+			}
+		}
+		EXPECT_LE(regions.size(), fsalloc::stats().faults - before.faults);
+	}
+}
+
+static sigjmp_buf gForeignJump;
+static void *gForeignAddr;
+
+TEST(Fsalloc, ForeignFault) {
+	// Earlier tests leave threads behind, whose locks a forked child could inherit taken
+	::testing::FLAGS_gtest_death_test_style = "threadsafe";
+
+	// Faults on no region are passed to the handler installed before, with their signal information,
+	// and without keeping the lock
+	EXPECT_EXIT({
+		alarm(10);
+		struct sigaction sa = {};
+		sa.sa_flags = SA_SIGINFO;
+		sa.sa_sigaction = [](int, siginfo_t *si, void *) {
+			gForeignAddr = si->si_addr;
+			siglongjmp(gForeignJump, 1);
+		};
+		sigaction(SIGSEGV, &sa, nullptr);
+
+		fsalloc::init("/tmp/fsalloc.bdb", 4);
+		int *freed = fsalloc::fsalloc<int>();
+		fsalloc::fsfree(freed);
+		if (sigsetjmp(gForeignJump, 1) == 0) {
+			*reinterpret_cast<volatile int *>(freed) = 1;
+		}
+
+		fsalloc::init("/tmp/fsalloc.bdb", 4);
+		int *live = fsalloc::fsalloc<int>();
+		*live = 2;
+		_exit(gForeignAddr == freed && *live == 2 ? 0 : 1);
+	}, ::testing::ExitedWithCode(0), "");
+
+	// Without such handler, the process crashes as it would without fsalloc
+	EXPECT_EXIT({
+		fsalloc::init("/tmp/fsalloc.bdb", 4);
+		int *freed = fsalloc::fsalloc<int>();
+		fsalloc::fsfree(freed);
+		*reinterpret_cast<volatile int *>(freed) = 1;
+		_exit(0);
+	}, ::testing::KilledBySignal(SIGSEGV), "");
+}
+
+TEST(Fsalloc, Metadata) {
+	const size_t kRegions = 12 << fsalloc::table::kChunkShift;
+	const uint32_t kChunks = 8;
+
+	fsalloc::init("/tmp/fsalloc.bdb", 64);
+	fsalloc::metadata(kChunks);
+
+	std::vector<unsigned *> regions;
+	for (size_t i = 0; i < kRegions; ++i) {
+		regions.push_back(fsalloc::fsalloc<unsigned>());
+		*regions.back() = i;
+	}
+
+	fsalloc::Occupancy occupancy = fsalloc::occupancy();
+	EXPECT_EQ(kRegions, occupancy.allocated);
+	EXPECT_GE(occupancy.metadata_chunks, 12u);
+	EXPECT_LE(occupancy.metadata_resident, kChunks);
+	EXPECT_GT(occupancy.metadata_spilled, 0u);
+
+	// Metadata of every region is paged back in on its fault
+	for (size_t i = 0; i < kRegions; i += 2) {
+		fsalloc::fsfree(regions[i]);
+	}
+	for (size_t i = 1; i < kRegions; i += 2) {
+		EXPECT_EQ(i, *regions[i]);
+	}
+	EXPECT_EQ(kRegions / 2, fsalloc::regions().size());
+	EXPECT_LE(fsalloc::occupancy().metadata_resident, kChunks);
+
+	fsalloc::metadata(fsalloc::table::kDefaultChunks);
+}
+
+TEST(Fsalloc, Pool) {
+	fsalloc::pool::init();
+	size_t used = fsalloc::pool::used();
+
+	char *block = static_cast<char *>(fsalloc::pool::allocate(100));
+	ASSERT_NE(nullptr, block);
+	memset(block, 'x', 100);
+	EXPECT_LT(used, fsalloc::pool::used());
+
+	// Contents survive moving to a larger block
+	char *grown = static_cast<char *>(fsalloc::pool::reallocate(block, 1000));
+	ASSERT_NE(nullptr, grown);
+	EXPECT_EQ(std::string(100, 'x'), std::string(grown, 100));
+
+	// Freed blocks are handed out again
+	fsalloc::pool::deallocate(grown);
+	EXPECT_EQ(used, fsalloc::pool::used());
+	EXPECT_EQ(grown, fsalloc::pool::allocate(1000));
+	fsalloc::pool::deallocate(grown);
+
+	// Pages of a large block are given back without touching the block right after it,
+	// which starts within the last page of the large one
+	const size_t kLarge = 100000;
+	char *large = static_cast<char *>(fsalloc::pool::allocate(kLarge));
+	char *next = static_cast<char *>(fsalloc::pool::allocate(kLarge));
+	while ((reinterpret_cast<uintptr_t>(next) - 2 * sizeof(void *)) % fsalloc::kPagesize == 0) {
+		fsalloc::pool::deallocate(next);
+		fsalloc::pool::deallocate(large);
+		fsalloc::pool::allocate(1);
+		large = static_cast<char *>(fsalloc::pool::allocate(kLarge));
+		next = static_cast<char *>(fsalloc::pool::allocate(kLarge));
+	}
+	memset(next, 'y', kLarge);
+	fsalloc::pool::deallocate(large);
+	EXPECT_EQ(kLarge, static_cast<size_t>(std::count(next, next + kLarge, 'y')));
+	fsalloc::pool::deallocate(next);
+}
+
+struct Point : public fsalloc::managed {
+	Point(int x, int y) : x(x), y(y) {}
+	int x, y;
+};
+
+TEST(Fsalloc, ResidentAlloc) {
+	fsalloc::init("/tmp/fsalloc.bdb", 4);
+
+	std::array<Point *, 64> points;
+	for (unsigned i = 0; i < points.size(); ++i) {
+		points[i] = i % 2 ? new Point(i, -i) : fsalloc::fsnew<Point>(i, -i);
+	}
+
+	for (unsigned i = 0; i < points.size(); ++i) {
+		EXPECT_EQ(static_cast<int>(i), points[i]->x);
+		EXPECT_EQ(-static_cast<int>(i), points[i]->y);
+	}
+
+	for (unsigned i = 0; i < points.size(); ++i) {
+		if (i % 2) {
+			delete points[i];
+		} else {
+			fsalloc::fsdelete(points[i]);
+		}
+	}
+}
+
+TEST(Fsalloc, FreeCached) {
+	fsalloc::init("/tmp/fsalloc.bdb", 8);
+
+	std::vector<int *> regions;
+	for (int i = 0; i < 8; ++i) {
+		regions.push_back(fsalloc::fsalloc<int>(fsalloc::Residency::resident));
+		*regions.back() = i;
+	}
+
+	// Regions leave the cache from any place in the queue
+	for (int i : {0, 3, 7}) {
+		fsalloc::fsfree(regions[i]);
+	}
+	EXPECT_EQ(5u, fsalloc::occupancy().cached);
+
+	for (int i = 0; i < 5; ++i) {
+		fsalloc::writeback();
+	}
+	EXPECT_EQ(0u, fsalloc::occupancy().cached);
+	for (int i : {1, 2, 4, 5, 6}) {
+		EXPECT_EQ(i, *regions[i]);
+	}
+
+	// Cache keeps at least the region just faulted in
+	fsalloc::capacity(0);
+	EXPECT_EQ(1u, fsalloc::occupancy().capacity);
+	for (int i : {1, 2, 4, 5, 6}) {
+		EXPECT_EQ(i, *regions[i]);
+	}
+}
+
+TEST(Fsalloc, Realloc) {
+	const uint32_t kPage = fsalloc::kPagesize;
+
+	fsalloc::init("/tmp/fsalloc.bdb", 4);
+
+	// Region grows and shrinks in place while its slot is large enough
+	char *small = static_cast<char *>(fsalloc::fsalloc(100, fsalloc::Residency::resident));
+	small[0] = 'a';
+	EXPECT_EQ(small, fsalloc::fsrealloc(small, kPage - 1));
+	small[kPage - 2] = 'b';
+	EXPECT_EQ(small, fsalloc::fsrealloc(small, 10));
+	EXPECT_EQ('a', small[0]);
+
+	// Otherwise it moves along with its contents
+	char *moved = static_cast<char *>(fsalloc::fsrealloc(small, 3 * kPage));
+	EXPECT_NE(small, moved);
+	EXPECT_EQ('a', moved[0]);
+	moved[3 * kPage - 1] = 'c';
+	EXPECT_EQ(1u, fsalloc::occupancy().allocated);
+
+	// Pages of a region grown step by step come from several mappings, and move along all the same
+	char *stepped = static_cast<char *>(fsalloc::fsalloc(2 * kPage, fsalloc::Residency::resident));
+	stepped[2 * kPage - 1] = '2';
+	for (uint32_t pages : {3, 5, 9}) {
+		stepped = static_cast<char *>(fsalloc::fsrealloc(stepped, pages * kPage));
+		stepped[pages * kPage - 1] = '0' + pages;
+	}
+	EXPECT_EQ('2', stepped[2 * kPage - 1]);
+	EXPECT_EQ('3', stepped[3 * kPage - 1]);
+	EXPECT_EQ('5', stepped[5 * kPage - 1]);
+	EXPECT_EQ('9', stepped[9 * kPage - 1]);
+	fsalloc::fsfree(stepped);
+
+	// Regions which are not resident are resized without being read
+	char *cold = static_cast<char *>(fsalloc::fsalloc(2 * kPage));
+	cold[0] = 'x';
+	cold[2 * kPage - 1] = 'y';
+	while (fsalloc::occupancy().cached > 0) {
+		fsalloc::writeback();
+	}
+	unsigned long long fetched = fsalloc::stats().bytes_fetched;
+	cold = static_cast<char *>(fsalloc::fsrealloc(cold, 64 * kPage));
+	EXPECT_EQ(fetched, fsalloc::stats().bytes_fetched);
+	EXPECT_EQ(0u, fsalloc::occupancy().cached);
+	EXPECT_EQ('x', cold[0]);
+	EXPECT_EQ('y', cold[2 * kPage - 1]);
+	EXPECT_EQ(0, cold[64 * kPage - 1]);
+
+	// Record of the grown region is written anew once it gets dirty
+	cold[64 * kPage - 1] = 'z';
+	while (fsalloc::occupancy().cached > 0) {
+		fsalloc::writeback();
+	}
+	EXPECT_EQ('x', cold[0]);
+	EXPECT_EQ('z', cold[64 * kPage - 1]);
+	EXPECT_EQ('c', moved[3 * kPage - 1]);
+
+	EXPECT_EQ(nullptr, fsalloc::fsrealloc(cold, 0));
+	char *fresh = static_cast<char *>(fsalloc::fsrealloc(nullptr, 10));
+	*fresh = 'f';
+	EXPECT_EQ(2u, fsalloc::occupancy().allocated);
+}
+
+TEST(Fsalloc, Flush) {
+	fsalloc::init("/tmp/fsalloc.bdb", 64);
+
+	std::array<int *, 32> arr;
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		arr[i] = fsalloc::fsalloc<int>();
+		*arr[i] = i;
+	}
+	fsalloc::flush();
+
+	// Flushed regions stay resident and get dirty again on write
+	for (unsigned i = 0; i < arr.size(); i += 2) {
+		*arr[i] += 100;
+	}
+	fsalloc::flush();
+	for (unsigned i = 0; i < 64; ++i) {
+		*fsalloc::fsalloc<int>() = 0;
+	}
+
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		EXPECT_EQ(i % 2 ? i : i + 100, static_cast<unsigned>(*arr[i]));
+	}
+}
+
+TEST(Fsalloc, Trace) {
+	const char *path = "/tmp/fsalloc.trace";
+
+	fsalloc::init("/tmp/fsalloc.bdb", 4);
+	fsalloc::startTrace(path, 4);
+
+	char *region = fsalloc::fsalloc<char>();
+	*region = 'x';
+	for (unsigned i = 0; i < 8; ++i) {
+		*fsalloc::fsalloc<char>() = 'y';
+	}
+	EXPECT_EQ('x', *region);
+	fsalloc::fsfree(region);
+	fsalloc::stopTrace();
+
+	auto records = fsalloc::trace::load(path);
+	ASSERT_FALSE(records.empty());
+	EXPECT_EQ(fsalloc::trace::Event::alloc, records.front().event);
+	EXPECT_EQ(reinterpret_cast<uintptr_t>(region), records.front().region);
+	EXPECT_EQ(fsalloc::trace::Event::write_fault, records[1].event);
+	EXPECT_EQ(fsalloc::trace::Event::free, records.back().event);
+
+	unsigned evictions = 0, reads = 0;
+	for (const auto &record : records) {
+		evictions += record.event == fsalloc::trace::Event::evict;
+		reads += record.event == fsalloc::trace::Event::read_fault;
+		EXPECT_LE(records.front().timestamp, record.timestamp);
+	}
+	EXPECT_LT(0u, evictions);
+	EXPECT_EQ(1u, reads);
+}
+
+TEST(Fsalloc, WritePrediction) {
+	fsalloc::init("/tmp/fsalloc.bdb", 8);
+	fsalloc::faultaround(1);
+
+	std::array<int *, 8> arr;
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		arr[i] = fsalloc::fsalloc<int>();
+		*arr[i] = i;
+	}
+	auto evictAll = [] {
+		while (fsalloc::occupancy().cached > 0) {
+			fsalloc::writeback();
+		}
+	};
+	evictAll();
+
+	// Region written before is installed writable, so writing it after a read takes no second fault
+	fsalloc::Stats before = fsalloc::stats();
+	EXPECT_EQ(4, *arr[4]);
+	*arr[4] = 40;
+	fsalloc::Stats stats = fsalloc::stats();
+	EXPECT_EQ(before.write_predictions + 1, stats.write_predictions);
+	EXPECT_EQ(before.write_faults, stats.write_faults);
+	EXPECT_EQ(before.faultarounds + 2, stats.faultarounds);
+
+	// Neighbours loaded along are not predicted
+	EXPECT_EQ(3u, fsalloc::occupancy().cached);
+	EXPECT_EQ(1u, fsalloc::occupancy().dirty);
+	evictAll();
+	EXPECT_EQ(before.speculative_writebacks, fsalloc::stats().speculative_writebacks);
+
+	// Writebacks of predicted regions which were not written are speculative
+	EXPECT_EQ(40, *arr[4]);
+	evictAll();
+	stats = fsalloc::stats();
+	EXPECT_EQ(before.write_predictions + 2, stats.write_predictions);
+	EXPECT_EQ(before.speculative_writebacks + 1, stats.speculative_writebacks);
+
+	fsalloc::faultaround(0);
+}
+
+TEST(Fsalloc, Stats) {
+	std::array<char *, 8> arr;
+
+	fsalloc::init("/tmp/fsalloc.bdb", 4);
+	fsalloc::readahead(0);
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		arr[i] = fsalloc::fsalloc<char>();
+		*arr[i] = i;
+	}
+	EXPECT_EQ(0, *arr[0]);
+
+	fsalloc::Stats stats = fsalloc::stats();
+	EXPECT_EQ(arr.size(), stats.allocs);
+	EXPECT_EQ(arr.size(), stats.write_faults);
+	EXPECT_EQ(arr.size(), stats.zero_fills);
+	EXPECT_EQ(1u, stats.read_faults);
+	EXPECT_EQ(0u, stats.cache_hits);
+	EXPECT_EQ(5u, stats.dirty_evictions);
+	EXPECT_EQ(5u, stats.bytes_written);
+	EXPECT_EQ(1u, stats.bytes_fetched);
+	EXPECT_EQ(4u * fsalloc::kPagesize, stats.resident_bytes);
+	// Region read back was written before, so it is predicted to be written again
+	EXPECT_EQ(4u * fsalloc::kPagesize, stats.dirty_bytes);
+	EXPECT_EQ(stats.faults, stats.fault_latency.count);
+	EXPECT_EQ(1u, stats.get_latency.count);
+	EXPECT_LE(stats.fault_latency.percentile(0.5), stats.fault_latency.percentile(1));
+
+	// Counters of other threads are merged, also once the thread exits
+	std::thread([] { fsalloc::fsfree(fsalloc::fsalloc<char>()); }).join();
+	stats = fsalloc::stats();
+	EXPECT_EQ(arr.size() + 1, stats.allocs);
+	EXPECT_EQ(1u, stats.frees);
+}
+
+TEST(Fsalloc, Transplant) {
+	unsigned long long syscalls[2];
+
+	for (bool enable : {true, false}) {
+		fsalloc::init("/tmp/fsalloc.bdb", 4);
+		fsalloc::readahead(0);
+		fsalloc::writeprediction(false);
+		fsalloc::transplant(enable);
+
+		std::array<int *, 64> arr;
+		for (unsigned i = 0; i < arr.size(); ++i) {
+			arr[i] = fsalloc::fsalloc<int>();
+			*arr[i] = i;
+		}
+
+		// Stored regions are filled either through staging pages or in place, with the same contents
+		for (unsigned i = 0; i < arr.size(); ++i) {
+			EXPECT_EQ(static_cast<int>(i), *arr[i]);
+		}
+		fsalloc::Stats before = fsalloc::stats();
+		for (unsigned i = 0; i < arr.size(); ++i) {
+			*arr[(i + arr.size() / 2) % arr.size()] += 1;
+		}
+		fsalloc::Stats stats = fsalloc::stats();
+		EXPECT_EQ(arr.size(), stats.faults - before.faults);
+		syscalls[enable] = stats.fault_syscalls - before.fault_syscalls;
+		for (unsigned i = 0; i < arr.size(); ++i) {
+			EXPECT_EQ(static_cast<int>(i) + 1, *arr[i]);
+		}
+	}
+
+	// Staged write fault takes a single mremap(), filling in place takes two mprotect() calls
+	EXPECT_LT(0u, syscalls[true]);
+	EXPECT_LT(syscalls[true], syscalls[false]);
+	fsalloc::transplant(true);
+	fsalloc::writeprediction(true);
+	fsalloc::readahead(fsalloc::kDefaultReadahead);
+}
+
+TEST(Fsalloc, PhaseTiming) {
+	fsalloc::init("/tmp/fsalloc.bdb", 2);
+	for (unsigned i = 0; i < 8; ++i) {
+		*fsalloc::fsalloc<int>() = i;
+	}
+
+	auto phases = fsalloc::phase::summary();
+	ASSERT_EQ(fsalloc::phase::kEnabled, !phases.empty());
+	for (const auto &phase : phases) {
+		EXPECT_LT(0u, phase.count);
+		EXPECT_LE(phase.max, phase.ticks);
+	}
+	if (fsalloc::phase::kEnabled) {
+		EXPECT_STREQ("fault", phases.front().name);
+		EXPECT_EQ(8u, phases.front().count);
+	}
+}
+
+/*! \brief Sums values of a profile dumped in folded stack format, storing the deepest stack to 'depth' */
+static unsigned long long folded(fsalloc::sites::Profile profile, fsalloc::sites::Metric metric,
+		unsigned *depth = nullptr) {
+	char *buffer = nullptr;
+	size_t size = 0;
+	unsigned long long sum = 0;
+
+	FILE *out = open_memstream(&buffer, &size);
+	fsalloc::profile(out, profile, metric);
+	fclose(out);
+
+	for (char *line = strtok(buffer, "\n"); line != nullptr; line = strtok(nullptr, "\n")) {
+		EXPECT_NE(nullptr, strchr(line, ' '));
+		sum += strtoull(strrchr(line, ' ') + 1, nullptr, 10);
+		if (depth != nullptr) {
+			*depth = std::max<unsigned>(*depth, 1 + std::count(line, strrchr(line, ' '), ';'));
+		}
+	}
+	free(buffer);
+	return sum;
+}
+
+TEST(Fsalloc, CallSites) {
+	using fsalloc::sites::Profile;
+	using fsalloc::sites::Metric;
+	std::array<int *, 16> arr;
+
+	fsalloc::init("/tmp/fsalloc.bdb", 4);
+	fsalloc::readahead(0);
+	fsalloc::sampling(1);
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		arr[i] = fsalloc::fsalloc<int>();
+		*arr[i] = i;
+	}
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		EXPECT_EQ(i, static_cast<unsigned>(*arr[i]));
+	}
+
+	fsalloc::Stats stats = fsalloc::stats();
+	EXPECT_EQ(stats.faults, folded(Profile::access, Metric::faults));
+	EXPECT_EQ(stats.bytes_fetched, folded(Profile::access, Metric::bytes));
+	EXPECT_EQ(stats.faults, folded(Profile::allocation, Metric::faults));
+	EXPECT_EQ(stats.clean_evictions + stats.dirty_evictions, folded(Profile::allocation, Metric::evictions));
+
+	// Stack of a thread which never allocated is not known in the fault handler, only the faulting instruction is
+	unsigned depth = 0;
+	fsalloc::sampling(1);
+	std::thread([&arr] {
+		for (unsigned i = 0; i < arr.size(); ++i) {
+			EXPECT_EQ(i, static_cast<unsigned>(*arr[i]));
+		}
+	}).join();
+	EXPECT_EQ(fsalloc::stats().faults - stats.faults, folded(Profile::access, Metric::faults, &depth));
+	EXPECT_EQ(1u, depth);
+
+	fsalloc::sampling(0);
+	EXPECT_EQ(0u, folded(Profile::access, Metric::faults));
+}
+
+TEST(Fsalloc, MovedRegion) {
+	using fsalloc::sites::Profile;
+	using fsalloc::sites::Metric;
+	auto evictAll = [] {
+		while (fsalloc::occupancy().cached > 0) {
+			fsalloc::writeback();
+		}
+	};
+
+	fsalloc::init("/tmp/fsalloc.bdb", 8);
+	fsalloc::readahead(0);
+	fsalloc::sampling(2);
+	int *unsampled = fsalloc::fsalloc<int>();
+	int *sampled = fsalloc::fsalloc<int>();
+	*unsampled = 1;
+	fsalloc::Stats before = fsalloc::stats();
+	*sampled = 7;
+	evictAll();
+
+	// Region moved while predicted keeps its checksum and allocation site
+	EXPECT_EQ(7, *sampled);
+	EXPECT_EQ(before.write_predictions + 1, fsalloc::stats().write_predictions);
+	int *moved = static_cast<int *>(fsalloc::fsrealloc(sampled, 4 * fsalloc::kPagesize));
+	ASSERT_NE(sampled, moved);
+	evictAll();
+	EXPECT_EQ(before.speculative_writebacks + 1, fsalloc::stats().speculative_writebacks);
+
+	EXPECT_EQ(7, *moved);
+	fsalloc::Stats stats = fsalloc::stats();
+	EXPECT_EQ(2 * (stats.faults - before.faults), folded(Profile::allocation, Metric::faults));
+
+	fsalloc::sampling(0);
+	fsalloc::readahead(fsalloc::kDefaultReadahead);
+}
+
+TEST(Fsalloc, MissRatioCurve) {
+	const unsigned kCapacity = 64;
+	std::array<int *, 4 * kCapacity> arr;
+	long sum = 0;
+
+	fsalloc::mrc::sampling(1);
+	fsalloc::init("/tmp/fsalloc.bdb", kCapacity);
+	fsalloc::readahead(0);
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		arr[i] = fsalloc::fsalloc<int>();
+		*arr[i] = i;
+	}
+
+	// Cyclic scan over a working set 4 times larger than cache faults on every access
+	for (unsigned pass = 0; pass < 2 * fsalloc::mrc::kEpochFaults / arr.size(); ++pass) {
+		for (int *p : arr) {
+			sum += *p;
+		}
+	}
+
+	const fsalloc::mrc::Curve &curve = fsalloc::curve();
+	ASSERT_LE(4u, curve.count);
+	EXPECT_EQ(kCapacity, curve.points[0].capacity);
+	EXPECT_DOUBLE_EQ(1.0, curve.points[0].ratio);
+	EXPECT_LT(0.9, curve.points[1].ratio);
+	EXPECT_EQ(2 * arr.size(), curve.points[3].capacity);
+	EXPECT_GT(0.1, curve.points[3].ratio);
+
+	// Autotuning grows cache to hold whole working set
+	fsalloc::autotune(1, 16 * kCapacity);
+	for (unsigned pass = 0; pass < fsalloc::mrc::kEpochFaults / arr.size(); ++pass) {
+		for (int *p : arr) {
+			sum += *p;
+		}
+	}
+	unsigned long long faults = fsalloc::stats().faults;
+	for (int *p : arr) {
+		sum += *p;
+	}
+	EXPECT_EQ(faults, fsalloc::stats().faults);
+	EXPECT_LT(0, sum);
+
+	fsalloc::autotune(0, 0);
+	fsalloc::mrc::sampling(fsalloc::mrc::kDefaultSampling);
+}
+
+TEST(Fsalloc, Admin) {
+	const char *path = "/tmp/fsalloc.sock";
+	std::array<int *, 8> arr;
+	long sum = 0;
+
+	fsalloc::init("/tmp/fsalloc.bdb", 4);
+	fsalloc::readahead(0);
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		arr[i] = fsalloc::fsalloc<int>();
+		*arr[i] = i;
+	}
+	// First region is faulted in more often than others, so it is the hottest
+	for (unsigned pass = 0; pass < 4; ++pass) {
+		sum += *arr[0];
+		for (unsigned i = 0; i < 4; ++i) {
+			fsalloc::writeback();
+		}
+	}
+	EXPECT_EQ(0, sum);
+
+	std::ostringstream hottest;
+	hottest << arr[0] << " ";
+	EXPECT_EQ(0u, fsalloc::admin::execute("top 1").find(hottest.str()));
+	EXPECT_EQ("ok\n", fsalloc::admin::execute("capacity 16"));
+	EXPECT_EQ(16u, fsalloc::occupancy().capacity);
+	EXPECT_EQ("ok\n", fsalloc::admin::execute("policy clock"));
+	EXPECT_EQ("ok\n", fsalloc::admin::execute("watermarks 0 0.25"));
+	for (int *p : arr) {
+		*p = 0;
+	}
+	EXPECT_GE(4u, fsalloc::occupancy().dirty);
+	EXPECT_EQ(0u, fsalloc::admin::execute("frobnicate").find("error: "));
+	EXPECT_EQ(0u, fsalloc::admin::execute("policy lru").find("error: "));
+
+	// Same commands are served over the socket
+	fsalloc::admin::start(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	ASSERT_EQ(0, connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)));
+	ASSERT_EQ(6, write(fd, "cache\n", 6));
+
+	std::string reply;
+	char buffer[256];
+	while (reply.find("ok\n") == std::string::npos) {
+		ssize_t received = read(fd, buffer, sizeof(buffer));
+		ASSERT_LT(0, received);
+		reply.append(buffer, received);
+	}
+	close(fd);
+	fsalloc::admin::stop();
+	EXPECT_NE(std::string::npos, reply.find("capacity: 16\n"));
+	EXPECT_NE(std::string::npos, reply.find("allocated: 8\n"));
+
+	fsalloc::policy(fsalloc::Policy::fifo);
+	fsalloc::watermarks(0, 0);
+}
+
+TEST(Fsalloc, Clock) {
+	fsalloc::policy(fsalloc::Policy::clock);
+	fsalloc::writeprediction(false);
+	fsalloc::readahead(0);
+
+	// Cycling over one region more than fit, each read faults once - a region just filled is never the one evicted,
+	// even if all others were referenced
+	for (uint32_t capacity = 1; capacity <= 2; ++capacity) {
+		std::vector<int *> arr(capacity + 1);
+		fsalloc::init("/tmp/fsalloc.bdb", capacity);
+		for (unsigned i = 0; i < arr.size(); ++i) {
+			arr[i] = fsalloc::fsalloc<int>();
+			*arr[i] = i;
+		}
+
+		const unsigned kAccesses = 8 * arr.size();
+		fsalloc::Stats before = fsalloc::stats();
+		for (unsigned i = 0; i < kAccesses; ++i) {
+			int *p = arr[i % arr.size()];
+			EXPECT_EQ(static_cast<int>(i), *p);
+			*p += arr.size();
+		}
+		fsalloc::Stats stats = fsalloc::stats();
+		EXPECT_EQ(kAccesses, stats.read_faults - before.read_faults);
+		EXPECT_EQ(kAccesses, stats.write_faults - before.write_faults);
+	}
+
+	fsalloc::policy(fsalloc::Policy::fifo);
+	fsalloc::writeprediction(true);
+	fsalloc::readahead(fsalloc::kDefaultReadahead);
+}
+
+TEST(Fsalloc, Options) {
+	char cwd[PATH_MAX];
+	ASSERT_NE(nullptr, getcwd(cwd, sizeof(cwd)));
+	mkdir("/tmp/fsalloc.dir", 0755);
+	ASSERT_EQ(0, chdir("/tmp"));
+
+	// Relative paths name files relative to the working directory, not to the environment home
+	fsalloc::Options options;
+	options.pagesize = 2 * fsalloc::kPagesize;
+	options.single_writer = false;
+	options.logging = true;
+	options.mmap_size = 1 << 20;
+	fsalloc::init("fsalloc.dir/options.bdb", 2, options);
+	ASSERT_EQ(0, chdir(cwd));
+
+	std::array<int *, 8> arr;
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		arr[i] = fsalloc::fsalloc<int>();
+		*arr[i] = i;
+	}
+	// Stored regions are written back in batches, each committed as a single transaction
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		*arr[i] += 1;
+	}
+	fsalloc::flush();
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		EXPECT_EQ(static_cast<int>(i) + 1, *arr[i]);
+	}
+	EXPECT_EQ(0, access("/tmp/fsalloc.dir/options.bdb", F_OK));
+	EXPECT_EQ(0, access("/tmp/fsalloc.dir/options.bdb.index", F_OK));
+	EXPECT_NE(0, access("/tmp/fsalloc.dir/fsalloc.dir", F_OK));
+	EXPECT_EQ(options.pagesize, fsalloc::db::classes().front().pagesize);
+
+	fsalloc::term();
+}
+
+TEST(Fsalloc, Inspect) {
+	const char *path = "/tmp/fsalloc.map";
+	std::array<int *, 32> arr;
+
+	fsalloc::init("/tmp/fsalloc.bdb", 4);
+	for (unsigned i = 0; i < arr.size(); ++i) {
+		arr[i] = fsalloc::fsalloc<int>();
+		*arr[i] = i;
+	}
+	fsalloc::flush();
+	for (unsigned i = 0; i < arr.size() - 8; i += 2) {
+		fsalloc::fsfree(arr[i]);
+	}
+	*fsalloc::fsalloc<int>() = 0;
+	fsalloc::fsalloc<int>();
+
+	fsalloc::inspect::dump(path);
+	auto map = fsalloc::inspect::load(path);
+	ASSERT_EQ(arr.size() / 2 + 6, map.size());
+
+	fsalloc::inspect::Report report = fsalloc::inspect::analyze(map);
+	ASSERT_EQ(1u, report.classes.size());
+	EXPECT_EQ(1u, report.unstored);
+	EXPECT_EQ(0u, report.missing);
+	EXPECT_EQ(arr.size() / 2 + 5, report.classes[0].live_records);
+	EXPECT_EQ((arr.size() / 2 + 5) * sizeof(int), report.classes[0].live_bytes);
+	EXPECT_EQ(0u, report.classes[0].dead_records);
+	EXPECT_EQ(arr.size() / 2 + 5, report.classes[0].sizes[3]);
+
+	// Records of regions missing from map are dead
+	map.erase(std::remove_if(map.begin(), map.end(), [&arr](const fsalloc::inspect::MapRecord &record) {
+		return record.region == reinterpret_cast<uintptr_t>(arr[1]);
+	}), map.end());
+	report = fsalloc::inspect::analyze(map);
+	EXPECT_EQ(1u, report.classes[0].dead_records);
+	EXPECT_EQ(sizeof(int), report.classes[0].dead_bytes);
+	EXPECT_LT(0.0, report.classes[0].fragmentation());
+
+	char *buffer = nullptr;
+	size_t size = 0;
+	FILE *out = open_memstream(&buffer, &size);
+	fsalloc::inspect::print(out, report);
+	fclose(out);
+	EXPECT_NE(nullptr, strstr(buffer, "class 0:"));
+	free(buffer);
+}
+
+TEST(Fsalloc, SizeClasses) {
+	const uint32_t kPage = fsalloc::kPagesize;
+	const std::array<uint32_t, 4> kSizes = {{sizeof(int), kPage, 3 * kPage + 5, 10 * kPage}};
+	const unsigned kCount = 3;
+
+	fsalloc::init("/tmp/fsalloc.bdb", 2);
+	for (unsigned i = 0; i < kCount; ++i) {
+		for (uint32_t size : kSizes) {
+			memset(fsalloc::fsalloc(size), 'a' + i, size);
+		}
+	}
+	fsalloc::flush();
+
+	// Each record lies whole on a page of the smallest class holding it, unless it exceeds the largest page
+	std::vector<fsalloc::db::sizeclass_t> classes;
+	std::vector<std::vector<uint32_t>> sizes(8);
+	fsalloc::scanStore([&classes](const std::vector<fsalloc::db::sizeclass_t> &store) {
+		classes = store;
+	}, [&sizes](const fsalloc::db::handle_t &rid, uint32_t size) {
+		sizes[fsalloc::db::classOf(rid)].push_back(size);
+	});
+	EXPECT_EQ(classes.size(), fsalloc::storeClasses().size());
+	ASSERT_EQ(kSizes.size(), classes.size());
+	for (unsigned i = 1; i < classes.size(); ++i) {
+		EXPECT_LT(classes[i - 1].pagesize, classes[i].pagesize);
+	}
+	for (unsigned i = 0; i < classes.size(); ++i) {
+		const std::vector<uint32_t> &stored = sizes[classes[i].cls];
+		EXPECT_EQ(std::vector<uint32_t>(kCount, kSizes[i]), stored);
+		EXPECT_TRUE(i + 1 == classes.size() || kSizes[i] < classes[i].pagesize);
+		EXPECT_TRUE(i == 0 || kSizes[i] > classes[i - 1].pagesize / 2);
+	}
+	fsalloc::term();
+
+	// Databases of every class are found again when the store is reopened for inspection
+	fsalloc::Options options;
+	options.readonly = true;
+	fsalloc::db::init("/tmp/fsalloc.bdb", options);
+	fsalloc::inspect::Report report = fsalloc::inspect::analyze({}, false);
+	ASSERT_EQ(kSizes.size(), report.classes.size());
+	for (unsigned i = 0; i < report.classes.size(); ++i) {
+		EXPECT_EQ(classes[i].cls, report.classes[i].cls);
+		EXPECT_EQ(classes[i].pagesize, report.classes[i].pagesize);
+		EXPECT_EQ(kCount, report.classes[i].live_records);
+		EXPECT_EQ(kCount * kSizes[i], report.classes[i].live_bytes);
+	}
+	fsalloc::db::term();
+}
@@ -0,0 +1,318 @@
+/*
+ * fsalloc_ycsb - YCSB-style macrobenchmark over fsalloc::managed records
+ *
+ * Builds a table of records managed by fsalloc, with the working set larger
+ * than the region cache, and runs one of the YCSB core workloads against it:
+ *   A - 50% reads, 50% updates
+ *   B - 95% reads, 5% updates
+ *   C - 100% reads
+ *   D - 95% reads, 5% inserts, latest records are the most popular
+ *   E - 95% short scans, 5% inserts
+ *   F - 50% reads, 50% read-modify-writes
+ *
+ * Usage:
+ *   fsalloc_ycsb [-w workload] [-d uniform|zipfian|latest] [-r records]
+ *                [-o operations] [-c capacity] [-p path] [-s seed]
+ */
+
+#include "fsalloc/fsalloc.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+const int kFields = 10;
+const int kFieldSize = 100;
+const int kMaxScan = 100;
+const double kZipfianConstant = 0.99;
+
+/*! \brief Single table record, stored by fsalloc */
+struct Record : public fsalloc::managed {
+	char fields[kFields][kFieldSize];
+
+	explicit Record(uint64_t key) {
+		for (int i = 0; i < kFields; ++i) {
+			memset(fields[i], 'a' + (key + i) % 26, kFieldSize);
+		}
+	}
+};
+
+/*! \brief Mix of operations making up a workload */
+struct Workload {
+	double read;
+	double update;
+	double insert;
+	double scan;
+	double rmw;
+	const char *distribution;
+};
+
+enum class Operation { read, update, insert, scan, rmw };
+
+/*! \brief Zipfian generator over [0, items), as in YCSB (Gray et al., "Quickly generating billion-record synthetic databases") */
+class Zipfian {
+public:
+	explicit Zipfian(uint64_t items, double theta = kZipfianConstant)
+		: items_(0), theta_(theta), zetan_(0) {
+		alpha_ = 1.0 / (1.0 - theta_);
+		zeta2_ = zeta(0, 2, 0);
+		grow(items);
+	}
+
+	/*! \brief Extends the range, updating zeta incrementally */
+	void grow(uint64_t items) {
+		zetan_ = zeta(items_, items, zetan_);
+		items_ = items;
+		eta_ = (1 - std::pow(2.0 / items_, 1 - theta_)) / (1 - zeta2_ / zetan_);
+	}
+
+	template<typename Random>
+	uint64_t next(Random &random) {
+		double u = std::uniform_real_distribution<double>(0, 1)(random);
+		double uz = u * zetan_;
+
+		if (uz < 1.0) {
+			return 0;
+		}
+		if (uz < 1.0 + std::pow(0.5, theta_)) {
+			return 1;
+		}
+		return std::min<uint64_t>(items_ - 1, items_ * std::pow(eta_ * u - eta_ + 1, alpha_));
+	}
+
+private:
+	double zeta(uint64_t from, uint64_t to, double initial) {
+		double sum = initial;
+		for (uint64_t i = from; i < to; ++i) {
+			sum += 1 / std::pow(i + 1, theta_);
+		}
+		return sum;
+	}
+
+	uint64_t items_;
+	double theta_;
+	double alpha_;
+	double zeta2_;
+	double zetan_;
+	double eta_;
+};
+
+/*! \brief Picks keys of existing records according to a request distribution */
+class KeyChooser {
+public:
+	KeyChooser(const std::string &distribution, uint64_t records)
+		: distribution_(distribution), records_(records), zipfian_(records) {
+		if (distribution != "uniform" && distribution != "zipfian" && distribution != "latest") {
+			throw std::invalid_argument("unknown distribution: " + distribution);
+		}
+	}
+
+	void inserted() {
+		records_++;
+		if (distribution_ != "uniform") {
+			zipfian_.grow(records_);
+		}
+	}
+
+	template<typename Random>
+	uint64_t next(Random &random) {
+		if (distribution_ == "uniform") {
+			return std::uniform_int_distribution<uint64_t>(0, records_ - 1)(random);
+		}
+
+		uint64_t rank = zipfian_.next(random);
+		if (distribution_ == "latest") {
+			return records_ - 1 - rank;
+		}
+		// Scatter popular keys over the table, so that they do not share neighbouring regions
+		return fnv(rank) % records_;
+	}
+
+private:
+	static uint64_t fnv(uint64_t value) {
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		for (int i = 0; i < 8; ++i) {
+			hash ^= value & 0xff;
+			hash *= 0x100000001b3ULL;
+			value >>= 8;
+		}
+		return hash;
+	}
+
+	std::string distribution_;
+	uint64_t records_;
+	Zipfian zipfian_;
+};
+
+Workload workload(char name) {
+	switch (name) {
+	case 'A': return {0.50, 0.50, 0.00, 0.00, 0.00, "zipfian"};
+	case 'B': return {0.95, 0.05, 0.00, 0.00, 0.00, "zipfian"};
+	case 'C': return {1.00, 0.00, 0.00, 0.00, 0.00, "zipfian"};
+	case 'D': return {0.95, 0.00, 0.05, 0.00, 0.00, "latest"};
+	case 'E': return {0.00, 0.00, 0.05, 0.95, 0.00, "zipfian"};
+	case 'F': return {0.50, 0.00, 0.00, 0.00, 0.50, "zipfian"};
+	default: throw std::invalid_argument(std::string("unknown workload: ") + name);
+	}
+}
+
+template<typename Random>
+Operation choose(const Workload &w, Random &random) {
+	double p = std::uniform_real_distribution<double>(0, 1)(random);
+
+	if ((p -= w.read) < 0) {
+		return Operation::read;
+	}
+	if ((p -= w.update) < 0) {
+		return Operation::update;
+	}
+	if ((p -= w.insert) < 0) {
+		return Operation::insert;
+	}
+	if ((p -= w.scan) < 0) {
+		return Operation::scan;
+	}
+	return Operation::rmw;
+}
+
+/*! \brief Reads all fields of a record, returning their checksum */
+long read(const Record *record) {
+	long sum = 0;
+	for (int i = 0; i < kFields; ++i) {
+		sum += record->fields[i][0] + record->fields[i][kFieldSize - 1];
+	}
+	return sum;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+	return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-w A-F] [-d uniform|zipfian|latest] [-r records] [-o operations] "
+			"[-c capacity] [-p path] [-s seed]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+	char name = 'A';
+	std::string distribution;
+	uint64_t records = 100000;
+	uint64_t operations = 1000000;
+	uint32_t capacity = 10000;
+	std::string path = "/tmp/fsalloc_ycsb.bdb";
+	unsigned seed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:d:r:o:c:p:s:")) != -1) {
+		switch (opt) {
+		case 'w': name = optarg[0]; break;
+		case 'd': distribution = optarg; break;
+		case 'r': records = strtoull(optarg, nullptr, 10); break;
+		case 'o': operations = strtoull(optarg, nullptr, 10); break;
+		case 'c': capacity = strtoul(optarg, nullptr, 10); break;
+		case 'p': path = optarg; break;
+		case 's': seed = strtoul(optarg, nullptr, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (records == 0) {
+		usage(argv[0]);
+	}
+
+	Workload w = workload(name);
+	if (distribution.empty()) {
+		distribution = w.distribution;
+	}
+
+	std::mt19937_64 random(seed);
+	KeyChooser keys(distribution, records);
+	std::vector<Record *> table;
+	std::vector<double> latencies;
+	Record scratch(0);
+	long checksum = 0;
+
+	fsalloc::init(path, capacity);
+
+	// Load phase
+	table.reserve(records + operations);
+	for (uint64_t key = 0; key < records; ++key) {
+		table.push_back(new Record(key));
+	}
+	fsalloc::flush();
+
+	// Run phase
+	fsalloc::Stats before = fsalloc::stats();
+	latencies.reserve(operations);
+	auto start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < operations; ++i) {
+		Operation op = choose(w, random);
+		auto begin = std::chrono::steady_clock::now();
+
+		switch (op) {
+		case Operation::read:
+			checksum += read(table[keys.next(random)]);
+			break;
+		case Operation::update:
+			memcpy(table[keys.next(random)]->fields[random() % kFields], scratch.fields[0], kFieldSize);
+			break;
+		case Operation::insert:
+			table.push_back(new Record(table.size()));
+			keys.inserted();
+			break;
+		case Operation::scan: {
+			uint64_t first = keys.next(random);
+			uint64_t last = std::min<uint64_t>(table.size(), first + 1 + random() % kMaxScan);
+			for (uint64_t key = first; key < last; ++key) {
+				checksum += read(table[key]);
+			}
+			break;
+		}
+		case Operation::rmw: {
+			Record *record = table[keys.next(random)];
+			checksum += read(record);
+			record->fields[random() % kFields][0]++;
+			break;
+		}
+		}
+
+		latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	fsalloc::Stats after = fsalloc::stats();
+
+	std::sort(latencies.begin(), latencies.end());
+	unsigned long long faults = after.faults - before.faults;
+	unsigned long long fills = faults - (after.cache_hits - before.cache_hits);
+
+	printf("workload: %c\n", name);
+	printf("distribution: %s\n", distribution.c_str());
+	printf("records: %llu\n", static_cast<unsigned long long>(records));
+	printf("operations: %llu\n", static_cast<unsigned long long>(operations));
+	printf("capacity: %u\n", capacity);
+	printf("ops_per_sec: %.0f\n", operations / elapsed);
+	printf("hit_rate: %.4f\n", 1.0 - std::min(1.0, static_cast<double>(fills) / operations));
+	printf("faults_per_op: %.4f\n", static_cast<double>(faults) / operations);
+	printf("writebacks_per_op: %.4f\n", static_cast<double>(after.writebacks - before.writebacks) / operations);
+	printf("latency_us_p50: %.2f\n", percentile(latencies, 0.50));
+	printf("latency_us_p95: %.2f\n", percentile(latencies, 0.95));
+	printf("latency_us_p99: %.2f\n", percentile(latencies, 0.99));
+	printf("latency_us_p999: %.2f\n", percentile(latencies, 0.999));
+	printf("latency_us_max: %.2f\n", latencies.empty() ? 0 : latencies.back());
+	printf("checksum: %ld\n", checksum);
+
+	fsalloc::term();
+	return 0;
+}
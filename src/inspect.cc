@@ -0,0 +1,237 @@
+#include "fsalloc/fsalloc.h"
+#include "fsalloc/inspect.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+
+using namespace fsalloc;
+using namespace fsalloc::inspect;
+
+static const char kShades[] = " .:-=+*#%@";
+static const unsigned kMapRows = 8;
+
+/*! \brief Returns key identifying a stored record */
+static uint64_t key(uint32_t pgno, uint16_t indx) {
+	return (static_cast<uint64_t>(pgno) << 16) | indx;
+}
+
+/*! \brief Returns size bucket of a record */
+static int bucket(uint32_t size) {
+	return size == 0 ? 0 : std::min(kSizeBuckets - 1, 32 - __builtin_clz(size));
+}
+
+/*! \brief Returns character shading a value within [0, 1] */
+static char shade(double value) {
+	if (value <= 0) {
+		return kShades[0];
+	}
+	int levels = sizeof(kShades) - 2;
+	return kShades[1 + std::min(levels - 1, static_cast<int>(value * levels))];
+}
+
+double Class::fragmentation() const {
+	double space = static_cast<double>(pages) * pagesize;
+	return space > 0 ? 1.0 - live_bytes / space : 0;
+}
+
+void fsalloc::inspect::dump(const std::string &path) {
+	MapHeader header;
+
+	sync();
+
+	std::vector<Region> allocations = regions();
+	std::vector<db::handle_t> metadata = metadataRecords();
+	std::vector<MapRecord> records;
+	records.reserve(allocations.size() + metadata.size());
+	for (Region &region : allocations) {
+		MapRecord record;
+		memset(&record, 0, sizeof(record));
+		record.region = reinterpret_cast<uintptr_t>(region.addr);
+		record.pgno = region.info.rid.pgno;
+		record.indx = region.info.rid.indx;
+		record.heat = region.info.heat;
+		record.size = region.info.size;
+		if (region.info.valid()) {
+			record.flags |= kStored;
+		}
+		if (region.info.cached) {
+			record.flags |= kCached;
+		}
+		if (region.info.dirty) {
+			record.flags |= kDirty;
+		}
+		records.push_back(record);
+	}
+	// Records of spilled metadata are live too, even though no region maps to them
+	for (const db::handle_t &rid : metadata) {
+		MapRecord record;
+		memset(&record, 0, sizeof(record));
+		record.pgno = rid.pgno;
+		record.indx = rid.indx;
+		record.flags = kStored | kMetadata;
+		records.push_back(record);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "FSMAP", 6);
+	header.version = kMapVersion;
+	header.count = records.size();
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(MapRecord));
+	if (!out) {
+		throw std::runtime_error("inspect: could not write " + path);
+	}
+}
+
+std::vector<MapRecord> fsalloc::inspect::load(const std::string &path) {
+	MapHeader header;
+	std::ifstream in(path, std::ios::binary);
+
+	if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))
+			|| memcmp(header.magic, "FSMAP", 6) != 0 || header.version != kMapVersion) {
+		throw std::runtime_error("inspect: " + path + " is not an allocation map");
+	}
+
+	std::vector<MapRecord> records(header.count);
+	if (!in.read(reinterpret_cast<char *>(records.data()), records.size() * sizeof(MapRecord))) {
+		throw std::runtime_error("inspect: " + path + " is truncated");
+	}
+	return records;
+}
+
+Report fsalloc::inspect::analyze(const std::vector<MapRecord> &map, bool mapped) {
+	Report report = Report();
+	std::unordered_map<uint64_t, const MapRecord *> stored;
+	Class *classes[8] = {};
+
+	report.mapped = mapped;
+	for (const MapRecord &record : map) {
+		if (record.flags & kMetadata) {
+			report.metadata++;
+		} else {
+			report.allocations++;
+		}
+		if (record.flags & kStored) {
+			stored[key(record.pgno, record.indx)] = &record;
+		} else {
+			report.unstored++;
+		}
+	}
+
+	scanStore([&](const std::vector<db::sizeclass_t> &store) {
+		for (const db::sizeclass_t &cls : store) {
+			Class c = Class();
+			c.cls = cls.cls;
+			c.pagesize = cls.pagesize;
+			c.pages = cls.pages;
+			c.layout.resize(cls.pages);
+			report.classes.push_back(c);
+		}
+		for (Class &c : report.classes) {
+			classes[c.cls] = &c;
+		}
+	}, [&](const db::handle_t &rid, uint32_t size) {
+		Class &c = *classes[db::classOf(rid)];
+		db_pgno_t pgno = db::pageOf(rid);
+		if (pgno >= c.layout.size()) {
+			c.layout.resize(pgno + 1);
+			c.pages = c.layout.size();
+		}
+
+		Page &page = c.layout[pgno];
+		auto it = stored.find(key(rid.pgno, rid.indx));
+		c.sizes[bucket(size)]++;
+		page.records++;
+		if (it != stored.end() || !mapped) {
+			c.live_records++;
+			c.live_bytes += size;
+			page.live_bytes += size;
+			if (it != stored.end()) {
+				page.heat += it->second->heat;
+				stored.erase(it);
+			}
+		} else {
+			c.dead_records++;
+			c.dead_bytes += size;
+			page.dead_bytes += size;
+		}
+	});
+
+	report.missing = mapped ? stored.size() : 0;
+	return report;
+}
+
+/*! \brief Prints layout of a class, each cell covering a run of pages */
+template<typename Value>
+static void layout(FILE *out, const char *name, const Class &c, unsigned width, Value value) {
+	size_t per = std::max<size_t>(1, (c.layout.size() + width * kMapRows - 1) / (width * kMapRows));
+	std::vector<double> cells;
+	double max = 0;
+
+	for (size_t first = 0; first < c.layout.size(); first += per) {
+		double sum = 0;
+		for (size_t pgno = first; pgno < std::min(first + per, c.layout.size()); ++pgno) {
+			sum += value(c.layout[pgno]);
+		}
+		cells.push_back(sum / per);
+		max = std::max(max, sum / per);
+	}
+
+	fprintf(out, "  %s (%zu page%s per cell):\n", name, per, per > 1 ? "s" : "");
+	for (size_t row = 0; row < cells.size(); row += width) {
+		fprintf(out, "    |");
+		for (size_t cell = row; cell < std::min(row + width, cells.size()); ++cell) {
+			fputc(shade(max > 0 ? cells[cell] / max : 0), out);
+		}
+		fprintf(out, "|\n");
+	}
+}
+
+void fsalloc::inspect::print(FILE *out, const Report &report, unsigned width) {
+	if (report.mapped) {
+		fprintf(out, "allocations: %llu (%llu never stored, %llu missing from store), metadata records: %llu\n",
+				static_cast<unsigned long long>(report.allocations),
+				static_cast<unsigned long long>(report.unstored),
+				static_cast<unsigned long long>(report.missing),
+				static_cast<unsigned long long>(report.metadata));
+	} else {
+		fprintf(out, "no allocation map - all records taken as live\n");
+	}
+
+	for (const Class &c : report.classes) {
+		uint64_t space = c.pages * c.pagesize;
+		fprintf(out, "class %d: pagesize %u, pages %llu, live %llu records / %llu bytes, "
+				"dead %llu records / %llu bytes, free %llu bytes, fragmentation %.1f%%\n",
+				c.cls, c.pagesize, static_cast<unsigned long long>(c.pages),
+				static_cast<unsigned long long>(c.live_records), static_cast<unsigned long long>(c.live_bytes),
+				static_cast<unsigned long long>(c.dead_records), static_cast<unsigned long long>(c.dead_bytes),
+				static_cast<unsigned long long>(space - std::min(space, c.live_bytes + c.dead_bytes)),
+				100 * c.fragmentation());
+
+		fprintf(out, "  sizes:");
+		for (int i = 0; i < kSizeBuckets; ++i) {
+			if (c.sizes[i] > 0) {
+				fprintf(out, " %llu-%llu:%llu", i == 0 ? 0ULL : 1ULL << (i - 1), (1ULL << i) - 1,
+						static_cast<unsigned long long>(c.sizes[i]));
+			}
+		}
+		fprintf(out, "\n");
+
+		if (c.layout.empty()) {
+			continue;
+		}
+		uint32_t pagesize = c.pagesize;
+		layout(out, "live bytes", c, width, [pagesize](const Page &page) {
+			return static_cast<double>(page.live_bytes) / pagesize;
+		});
+		if (report.mapped) {
+			layout(out, "heat", c, width, [](const Page &page) { return static_cast<double>(page.heat); });
+		}
+	}
+}
@@ -0,0 +1,101 @@
+#ifndef __FSALLOC_INSPECT_H
+#define __FSALLOC_INSPECT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace fsalloc { namespace inspect {
+
+/*
+ * Inspection of the backing store.
+ *
+ * A running heap dumps its allocation map with dump(). The store is then
+ * scanned (by the same process, or by fsalloc_inspect opening it read-only)
+ * and every record is matched against the map: records referenced by an
+ * allocation are live, others are dead. The report tells how records of
+ * each size class are spread over database pages, how much space is wasted,
+ * and where on disk the most often faulting regions sit.
+ */
+
+static const uint32_t kMapVersion = 1;
+static const int kSizeBuckets = 33;
+
+/*! \brief Header of allocation map file */
+struct MapHeader {
+	char magic[8];  /*!< "FSMAP" */
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t count; /*!< number of records following header */
+};
+
+/*! \brief Flags of an allocation */
+enum : uint32_t {
+	kStored = 0x1, /*!< region has a record in store */
+	kCached = 0x2, /*!< region was resident */
+	kDirty = 0x4,  /*!< region differed from its record */
+	kMetadata = 0x8 /*!< record holds spilled metadata instead of a region */
+};
+
+/*! \brief Single allocation, as stored in a map file */
+struct MapRecord {
+	uint64_t region; /*!< address of region */
+	uint32_t pgno;   /*!< record handle, including size class bits */
+	uint16_t indx;
+	uint16_t heat;   /*!< number of faults on region */
+	uint32_t size;
+	uint32_t flags;
+};
+
+/*! \brief Usage of a single database page */
+struct Page {
+	uint32_t records;
+	uint32_t live_bytes;
+	uint32_t dead_bytes;
+	uint32_t heat; /*!< faults on regions stored on page */
+};
+
+/*! \brief Usage of a single size class */
+struct Class {
+	int cls;
+	uint32_t pagesize;
+	uint64_t pages;
+	uint64_t live_records;
+	uint64_t live_bytes;
+	uint64_t dead_records;
+	uint64_t dead_bytes;
+	uint64_t sizes[kSizeBuckets]; /*!< records of sizes [2^(i-1), 2^i) */
+	std::vector<Page> layout;     /*!< indexed by page number */
+
+	/*! \brief Returns fraction of file space not taken by live records */
+	double fragmentation() const;
+};
+
+/*! \brief Result of inspection */
+struct Report {
+	std::vector<Class> classes;
+	uint64_t allocations; /*!< allocations in map */
+	uint64_t unstored;    /*!< allocations never written to store */
+	uint64_t missing;     /*!< allocations whose record is not in store */
+	uint64_t metadata;    /*!< records holding spilled metadata */
+	bool mapped;          /*!< false if no map was given and all records were taken as live */
+};
+
+/*! \brief Writes allocation map of the running heap, flushing dirty regions first so that store matches it */
+void dump(const std::string &path);
+
+/*! \brief Reads allocation map written by dump() */
+std::vector<MapRecord> load(const std::string &path);
+
+/*! \brief Scans the open store, matching records against 'map' if 'mapped' is set
+ * A live heap keeps running, only its writebacks wait for the scan.
+ */
+Report analyze(const std::vector<MapRecord> &map, bool mapped = true);
+
+/*! \brief Prints report with layout maps 'width' characters wide */
+void print(FILE *out, const Report &report, unsigned width = 64);
+
+} }
+
+#endif // __FSALLOC_INSPECT_H
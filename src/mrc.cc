@@ -0,0 +1,231 @@
+#include "fsalloc/mrc.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+
+using namespace fsalloc;
+using namespace fsalloc::mrc;
+
+/*
+ * Refault distances are kept in a log-linear histogram: every power of two
+ * range is split into 4 equal buckets, distances below 4 have buckets of their own.
+ *
+ * gThreshold - regions hashing below it are sampled
+ * gRate      - fraction of regions sampled
+ * gGhosts    - sampled regions evicted from cache, with their eviction stamps; a fixed table,
+ *              so that evictions and fetches never allocate while a fault is handled
+ * gSweep     - next ghost checked for expiry
+ * gEvictions - number of evictions so far
+ * gHistogram - sampled refault distances in current epoch
+ * gFaults    - faults in current epoch
+ * gStart     - time current epoch started, in seconds
+ * gCurve     - curve estimated in last epoch
+ */
+namespace {
+	const int kSubBuckets = 4;
+	const int kBuckets = 40 * kSubBuckets;
+	const uint32_t kGhosts = 1u << 18;
+	const uint32_t kProbes = 8;
+	// Ghosts checked for expiry per fault, so that the table is swept once per epoch
+	const uint32_t kSweep = kGhosts / kEpochFaults;
+
+	/*! \brief Sampled region evicted from cache */
+	struct Ghost {
+		uintptr_t region; /*!< address of region, 0 for an empty slot */
+		uint64_t stamp;   /*!< number of evictions when region was evicted */
+	};
+
+	uint64_t gThreshold = kDefaultSampling * (1ULL << 32);
+	double gRate = kDefaultSampling;
+	Ghost gGhosts[kGhosts];
+	uint32_t gSweep;
+	uint64_t gEvictions;
+	uint64_t gHistogram[kBuckets];
+	uint32_t gFaults;
+	double gStart;
+	Curve gCurve;
+}
+
+/*! \brief Returns monotonic time in seconds */
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*! \brief Returns hash of region, lower half of which decides whether region is sampled */
+static uint64_t hash(const void *region) {
+	// Finalizer of MurmurHash3 - spreads neighbouring addresses evenly
+	uint64_t h = reinterpret_cast<uintptr_t>(region);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*! \brief Returns true iff region belongs to the sample */
+static bool sampled(const void *region) {
+	return (hash(region) & 0xffffffff) < gThreshold;
+}
+
+/*! \brief Returns slot of a ghost of region, or nullptr; 'replaced' is set to the slot a new ghost would take */
+static Ghost *ghostOf(const void *region, Ghost *&replaced) {
+	uintptr_t key = reinterpret_cast<uintptr_t>(region);
+	uint32_t first = hash(region) >> 32;
+
+	replaced = nullptr;
+	for (uint32_t i = 0; i < kProbes; ++i) {
+		Ghost &ghost = gGhosts[(first + i) & (kGhosts - 1)];
+		if (ghost.region == key) {
+			return &ghost;
+		}
+		// A free slot is taken first, otherwise the oldest ghost makes room
+		if (replaced == nullptr || (replaced->region != 0 && (ghost.region == 0 || ghost.stamp < replaced->stamp))) {
+			replaced = &ghost;
+		}
+	}
+	return nullptr;
+}
+
+/*! \brief Returns index of the highest set bit */
+static int log2(uint64_t value) {
+	return 63 - __builtin_clzll(value);
+}
+
+/*! \brief Returns histogram bucket of a refault distance */
+static int bucket(uint64_t distance) {
+	if (distance < kSubBuckets) {
+		return distance;
+	}
+	int shift = log2(distance) - 2;
+	return std::min<uint64_t>(kSubBuckets * (shift + 1) + ((distance >> shift) & (kSubBuckets - 1)), kBuckets - 1);
+}
+
+/*! \brief Returns the smallest distance falling into bucket */
+static uint64_t lower(int bucket) {
+	if (bucket < kSubBuckets) {
+		return bucket;
+	}
+	int shift = bucket / kSubBuckets - 1;
+	return static_cast<uint64_t>(kSubBuckets + bucket % kSubBuckets) << shift;
+}
+
+/*! \brief Returns number of sampled refaults with distance up to 'extra', interpolating within buckets */
+static double saved(uint64_t extra) {
+	double sum = 0;
+
+	for (int i = 0; i < kBuckets && lower(i) <= extra; ++i) {
+		uint64_t width = i < kSubBuckets ? 1 : 1ULL << (i / kSubBuckets - 1);
+		sum += gHistogram[i] * std::min(1.0, static_cast<double>(extra - lower(i) + 1) / width);
+	}
+	return sum;
+}
+
+void fsalloc::mrc::sampling(double rate) {
+	gRate = std::min(1.0, std::max(rate, 1.0 / (1ULL << 32)));
+	gThreshold = gRate * (1ULL << 32);
+	reset();
+}
+
+void fsalloc::mrc::reset() {
+	memset(gGhosts, 0, sizeof(gGhosts));
+	gSweep = 0;
+	gEvictions = 0;
+	std::fill(std::begin(gHistogram), std::end(gHistogram), 0);
+	gFaults = 0;
+	gStart = now();
+	gCurve = Curve();
+}
+
+void fsalloc::mrc::evicted(const void *region) {
+	gEvictions++;
+	if (sampled(region)) {
+		Ghost *replaced, *ghost = ghostOf(region, replaced);
+		if (ghost == nullptr) {
+			ghost = replaced;
+		}
+		*ghost = {reinterpret_cast<uintptr_t>(region), gEvictions};
+	}
+}
+
+void fsalloc::mrc::moved(const void *from, const void *to) {
+	if (!sampled(from)) {
+		return;
+	}
+
+	Ghost *replaced, *ghost = ghostOf(from, replaced);
+	if (ghost == nullptr) {
+		return;
+	}
+	uint64_t stamp = ghost->stamp;
+	*ghost = Ghost();
+
+	if (sampled(to)) {
+		ghost = ghostOf(to, replaced);
+		if (ghost == nullptr) {
+			ghost = replaced;
+		}
+		*ghost = {reinterpret_cast<uintptr_t>(to), stamp};
+	}
+}
+
+void fsalloc::mrc::fetched(const void *region) {
+	if (!sampled(region)) {
+		return;
+	}
+
+	Ghost *replaced, *ghost = ghostOf(region, replaced);
+	if (ghost != nullptr) {
+		// The region would have stayed resident in a cache larger by 'distance' regions
+		gHistogram[bucket(gEvictions - ghost->stamp + 1)]++;
+		*ghost = Ghost();
+	}
+}
+
+bool fsalloc::mrc::tick(uint32_t capacity) {
+	// Ghosts which could not fit even the largest estimated cache are forgotten - a few on every fault
+	// instead of the whole table at the end of an epoch, which would stall the fault handler
+	uint64_t horizon = static_cast<uint64_t>(capacity) << (kPoints - 1);
+	for (uint32_t i = 0; i < kSweep; ++i) {
+		Ghost &ghost = gGhosts[gSweep];
+		if (ghost.region != 0 && gEvictions - ghost.stamp > horizon) {
+			ghost = Ghost();
+		}
+		gSweep = (gSweep + 1) & (kGhosts - 1);
+	}
+
+	if (++gFaults < kEpochFaults) {
+		return false;
+	}
+
+	double elapsed = std::max(now() - gStart, 1e-9);
+
+	// Point 'k' is a cache 2^k times larger than the current one
+	gCurve.count = 0;
+	for (int k = 0; k < kPoints; ++k) {
+		if (capacity == 0 || (static_cast<uint64_t>(capacity) << k) > UINT32_MAX) {
+			break;
+		}
+
+		double faults = std::max(0.0, gFaults - saved((capacity << k) - capacity) / gRate);
+		Point &point = gCurve.points[gCurve.count++];
+		point.capacity = capacity << k;
+		point.ratio = faults / gFaults;
+		point.rate = faults / elapsed;
+	}
+
+	std::fill(std::begin(gHistogram), std::end(gHistogram), 0);
+	gFaults = 0;
+	gStart = now();
+	return true;
+}
+
+const Curve &fsalloc::mrc::curve() {
+	return gCurve;
+}
@@ -0,0 +1,58 @@
+#ifndef __FSALLOC_MRC_H
+#define __FSALLOC_MRC_H
+
+#include <cstdint>
+
+namespace fsalloc { namespace mrc {
+
+/*
+ * Online miss ratio curve estimation.
+ *
+ * A hashed sample of regions (SHARDS-style spatial sampling) is remembered
+ * as ghosts when evicted. When a sampled ghost faults again, the number of
+ * evictions since its own tells how much larger the cache would have had to
+ * be to keep it, which gives the faults saved at every larger capacity.
+ * Only faults are observed, so the curve starts at the current capacity.
+ */
+
+static const int kPoints = 7;
+static const double kDefaultSampling = 1.0 / 32;
+static const uint32_t kEpochFaults = 4096;
+
+/*! \brief Estimated faults at a given cache capacity */
+struct Point {
+	uint32_t capacity; /*!< capacity of region cache */
+	double ratio;      /*!< faults relative to the current capacity */
+	double rate;       /*!< faults per second */
+};
+
+/*! \brief Estimated miss ratio curve, from the current capacity up to 64 times as large */
+struct Curve {
+	Point points[kPoints];
+	uint32_t count; /*!< number of valid points, 0 until the first epoch ends */
+};
+
+/*! \brief Sets fraction of regions sampled, starting a new estimate */
+void sampling(double rate);
+
+/*! \brief Drops all gathered samples */
+void reset();
+
+/*! \brief Notes eviction of a region */
+void evicted(const void *region);
+
+/*! \brief Notes a region moving to another address, its ghost moves along if both addresses are sampled */
+void moved(const void *from, const void *to);
+
+/*! \brief Notes a fault which fetched region from storage */
+void fetched(const void *region);
+
+/*! \brief Counts a fault, returns true iff it ends an epoch and a new curve is ready */
+bool tick(uint32_t capacity);
+
+/*! \brief Returns curve estimated at the end of last epoch */
+const Curve &curve();
+
+} }
+
+#endif // __FSALLOC_MRC_H
@@ -0,0 +1,94 @@
+#include "fsalloc/phase.h"
+
+#include <time.h>
+
+#include <atomic>
+
+using namespace fsalloc;
+using namespace fsalloc::phase;
+
+static const char *kNames[] = {"fault", "lookup", "protect", "remap", "get", "put", "evict"};
+static_assert(sizeof(kNames) / sizeof(kNames[0]) == static_cast<size_t>(Phase::count), "every phase needs a name");
+
+/*! \brief Timing of a single phase, updated by any thread */
+struct Counter {
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> ticks;
+	std::atomic<uint64_t> max;
+};
+
+/*
+ * gCounters - timing of every phase
+ */
+namespace {
+	Counter gCounters[static_cast<size_t>(Phase::count)];
+}
+
+#ifdef FSALLOC_PHASE_TIMING
+
+void fsalloc::phase::account(Phase phase, uint64_t elapsed) {
+	Counter &counter = gCounters[static_cast<size_t>(phase)];
+	uint64_t max = counter.max.load(std::memory_order_relaxed);
+
+	counter.count.fetch_add(1, std::memory_order_relaxed);
+	counter.ticks.fetch_add(elapsed, std::memory_order_relaxed);
+	while (elapsed > max && !counter.max.compare_exchange_weak(max, elapsed, std::memory_order_relaxed)) {
+	}
+}
+
+/*! \brief Returns nanoseconds per tick, measured once against the monotonic clock */
+static double calibrate() {
+	static double ns_per_tick = [] {
+		struct timespec start, end, pause = {0, 10000000};
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		uint64_t first = ticks();
+		nanosleep(&pause, nullptr);
+		uint64_t last = ticks();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+		return last > first ? ns / (last - first) : 1.0;
+	}();
+	return ns_per_tick;
+}
+
+std::vector<Summary> fsalloc::phase::summary() {
+	std::vector<Summary> phases;
+
+	for (size_t i = 0; i < static_cast<size_t>(Phase::count); ++i) {
+		const Counter &counter = gCounters[i];
+		Summary phase = {kNames[i], counter.count, counter.ticks, counter.max, 0};
+		if (phase.count > 0) {
+			phase.ns = phase.ticks * calibrate();
+			phases.push_back(phase);
+		}
+	}
+	return phases;
+}
+
+#else
+
+std::vector<Summary> fsalloc::phase::summary() {
+	return std::vector<Summary>();
+}
+
+#endif
+
+void fsalloc::phase::dump(FILE *out) {
+	fprintf(out, "phase,count,ticks,max_ticks,ns,mean_ns\n");
+	for (const Summary &phase : summary()) {
+		fprintf(out, "%s,%llu,%llu,%llu,%.0f,%.1f\n", phase.name,
+				static_cast<unsigned long long>(phase.count),
+				static_cast<unsigned long long>(phase.ticks),
+				static_cast<unsigned long long>(phase.max),
+				phase.ns, phase.ns / phase.count);
+	}
+}
+
+void fsalloc::phase::reset() {
+	for (Counter &counter : gCounters) {
+		counter.count = 0;
+		counter.ticks = 0;
+		counter.max = 0;
+	}
+}
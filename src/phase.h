@@ -0,0 +1,103 @@
+#ifndef __FSALLOC_PHASE_H
+#define __FSALLOC_PHASE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#ifdef FSALLOC_PHASE_TIMING
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+#endif
+
+namespace fsalloc { namespace phase {
+
+/*
+ * Breakdown of time spent handling faults and writing regions back.
+ *
+ * Built only with FSALLOC_PHASE_TIMING defined - otherwise FSALLOC_PHASE()
+ * expands to nothing and summary() is empty. Phases nest (eviction includes
+ * the puts and remaps it issues, fault includes everything), so their times
+ * should be compared with their parents rather than summed.
+ */
+
+/*! \brief Timed part of fault handling or writeback */
+enum class Phase : uint8_t {
+	fault,   /*!< whole fault handler */
+	lookup,  /*!< finding region in allocation map */
+	protect, /*!< mprotect() calls */
+	remap,   /*!< mmap()/mremap() calls dropping or transplanting pages */
+	get,     /*!< reading and copying region contents from database */
+	put,     /*!< writing regions to database */
+	evict,   /*!< evicting regions from cache */
+	count
+};
+
+/*! \brief Aggregated timing of a single phase */
+struct Summary {
+	const char *name;
+	uint64_t count;  /*!< number of times phase was entered */
+	uint64_t ticks;  /*!< total time spent in phase, in timestamp counter ticks */
+	uint64_t max;    /*!< longest single pass through phase, in ticks */
+	double ns;       /*!< total time spent in phase, in nanoseconds */
+};
+
+#ifdef FSALLOC_PHASE_TIMING
+static const bool kEnabled = true;
+#else
+static const bool kEnabled = false;
+#endif
+
+/*! \brief Returns timing of every phase entered at least once */
+std::vector<Summary> summary();
+
+/*! \brief Writes timing of every phase in CSV format */
+void dump(FILE *out);
+
+/*! \brief Clears gathered timing */
+void reset();
+
+#ifdef FSALLOC_PHASE_TIMING
+
+/*! \brief Returns current value of timestamp counter */
+inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*! \brief Adds a pass through phase which took 'elapsed' ticks */
+void account(Phase phase, uint64_t elapsed);
+
+/*! \brief Times a phase until the end of enclosing scope */
+class Scope {
+public:
+	explicit Scope(Phase phase) : phase_(phase), start_(ticks()) {}
+	~Scope() { account(phase_, ticks() - start_); }
+
+	Scope(const Scope &) = delete;
+	Scope &operator=(const Scope &) = delete;
+
+private:
+	Phase phase_;
+	uint64_t start_;
+};
+
+#define FSALLOC_PHASE(name) ::fsalloc::phase::Scope phase_scope(::fsalloc::phase::Phase::name)
+
+#else
+
+#define FSALLOC_PHASE(name) do {} while (0)
+
+#endif
+
+} }
+
+#endif // __FSALLOC_PHASE_H
@@ -0,0 +1,156 @@
+#include "fsalloc/fsalloc.h"
+#include "fsalloc/pool.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+using namespace fsalloc;
+
+namespace {
+
+const int kMinShift = 5;
+const int kClasses = 48;
+const size_t kMaxReserve = 1ULL << 40;
+const size_t kMinReserve = 1ULL << 28;
+const size_t kReturnedSize = 64 * 1024;
+
+/*! \brief Header preceding every block, also linking free blocks */
+struct Header {
+	uint64_t cls;
+	Header *next;
+};
+
+/*
+ * gBase  - first byte of the pool
+ * gSize  - number of bytes reserved
+ * gTop   - number of bytes ever handed out, blocks past it are untouched
+ * gFree  - freed blocks of every class
+ * gUsed  - number of bytes taken by blocks handed out
+ * gLock  - guards all of the above; a fault never interrupts the thread holding
+ *          it, as the pool is not managed by fsalloc
+ */
+char *gBase;
+size_t gSize;
+size_t gTop;
+Header *gFree[kClasses];
+size_t gUsed;
+std::atomic_flag gLock = ATOMIC_FLAG_INIT;
+
+/*! \brief Holds gLock in scope */
+class Hold {
+public:
+	Hold() {
+		while (gLock.test_and_set(std::memory_order_acquire)) {
+		}
+	}
+
+	~Hold() {
+		gLock.clear(std::memory_order_release);
+	}
+};
+
+}
+
+/*! \brief Returns class of blocks holding 'size' bytes along with the header */
+static int classOf(size_t size) {
+	size += sizeof(Header);
+	int cls = kMinShift;
+	while (cls < kClasses && (1ULL << cls) < size) {
+		cls++;
+	}
+	return cls;
+}
+
+void fsalloc::pool::init() {
+	if (gBase != nullptr) {
+		return;
+	}
+
+	// Largest range the system agrees to reserve, pages are only taken once touched
+	for (size_t size = kMaxReserve; size >= kMinReserve && gBase == nullptr; size /= 2) {
+		void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (addr != MAP_FAILED) {
+			gBase = static_cast<char *>(addr);
+			gSize = size;
+		}
+	}
+	if (gBase == nullptr) {
+		throw std::runtime_error("fsalloc: could not reserve memory pool");
+	}
+}
+
+void *fsalloc::pool::allocate(size_t size) {
+	int cls = classOf(size);
+	Header *header;
+
+	if (cls >= kClasses) {
+		return nullptr;
+	}
+
+	Hold hold;
+	if (gFree[cls] != nullptr) {
+		header = gFree[cls];
+		gFree[cls] = header->next;
+	} else if (gTop + (1ULL << cls) <= gSize) {
+		header = reinterpret_cast<Header *>(gBase + gTop);
+		gTop += 1ULL << cls;
+	} else {
+		return nullptr;
+	}
+
+	header->cls = cls;
+	header->next = nullptr;
+	gUsed += 1ULL << cls;
+	return header + 1;
+}
+
+void *fsalloc::pool::reallocate(void *block, size_t size) {
+	if (block == nullptr) {
+		return allocate(size);
+	}
+
+	Header *header = static_cast<Header *>(block) - 1;
+	if (classOf(size) == static_cast<int>(header->cls)) {
+		return block;
+	}
+
+	void *moved = allocate(size);
+	if (moved != nullptr) {
+		memcpy(moved, block, std::min<size_t>(size, (1ULL << header->cls) - sizeof(Header)));
+		deallocate(block);
+	}
+	return moved;
+}
+
+void fsalloc::pool::deallocate(void *block) {
+	if (block == nullptr) {
+		return;
+	}
+
+	Header *header = static_cast<Header *>(block) - 1;
+	size_t size = 1ULL << header->cls;
+	if (size >= kReturnedSize) {
+		// Pages lying wholly within the block are given back, and read as zeros when reused -
+		// those shared with the header or the next block keep their contents
+		uintptr_t first = (reinterpret_cast<uintptr_t>(block) + kPagesize - 1) & ~(kPagesize - 1);
+		uintptr_t last = (reinterpret_cast<uintptr_t>(header) + size) & ~(kPagesize - 1);
+		if (last > first) {
+			madvise(reinterpret_cast<void *>(first), last - first, MADV_DONTNEED);
+		}
+	}
+
+	Hold hold;
+	header->next = gFree[header->cls];
+	gFree[header->cls] = header;
+	gUsed -= size;
+}
+
+size_t fsalloc::pool::used() {
+	Hold hold;
+	return gUsed;
+}
@@ -0,0 +1,35 @@
+#ifndef __FSALLOC_POOL_H
+#define __FSALLOC_POOL_H
+
+#include <cstddef>
+
+namespace fsalloc { namespace pool {
+
+/*
+ * Allocator of memory used by the storage library.
+ *
+ * Regions are fetched and written back from the SIGSEGV handler, which may
+ * interrupt code holding locks of malloc. Memory of the storage library is
+ * therefore carved from an address range reserved up front instead, in
+ * power of two blocks kept on free lists of their size. Neither allocation
+ * nor release makes a system call, except for returning pages of large
+ * freed blocks, so both are safe to call while handling a fault.
+ */
+
+/*! \brief Reserves address space of the pool; later calls do nothing */
+void init();
+
+/*! \brief Returns a block of at least 'size' bytes, or nullptr if the pool is exhausted */
+void *allocate(size_t size);
+
+/*! \brief Resizes a block as realloc() does */
+void *reallocate(void *block, size_t size);
+
+void deallocate(void *block);
+
+/*! \brief Returns number of bytes taken by blocks handed out */
+size_t used();
+
+} }
+
+#endif // __FSALLOC_POOL_H
@@ -0,0 +1,22 @@
+#include "fsalloc/probes.h"
+
+#ifdef FSALLOC_HAS_PROBES
+
+/*
+ * Probe semaphores - a tracer increments them while attached to a probe.
+ * They have to live in the .probes section to be found by tracers.
+ */
+#define FSALLOC_PROBE_SEMAPHORE_DEFINE(name) \
+	extern "C" __attribute__((section(".probes"))) unsigned short fsalloc_##name##_semaphore = 0
+
+FSALLOC_PROBE_SEMAPHORE_DEFINE(alloc);
+FSALLOC_PROBE_SEMAPHORE_DEFINE(free);
+FSALLOC_PROBE_SEMAPHORE_DEFINE(fault__entry);
+FSALLOC_PROBE_SEMAPHORE_DEFINE(fault__return);
+FSALLOC_PROBE_SEMAPHORE_DEFINE(evict);
+FSALLOC_PROBE_SEMAPHORE_DEFINE(db__get);
+FSALLOC_PROBE_SEMAPHORE_DEFINE(db__put);
+FSALLOC_PROBE_SEMAPHORE_DEFINE(db__put__batch);
+FSALLOC_PROBE_SEMAPHORE_DEFINE(db__del);
+
+#endif
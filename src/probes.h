@@ -0,0 +1,79 @@
+#ifndef __FSALLOC_PROBES_H
+#define __FSALLOC_PROBES_H
+
+/*
+ * USDT static tracepoints of provider 'fsalloc', usable from bpftrace, perf and SystemTap:
+ *   alloc(addr, size, resident)        fsalloc() returned a region
+ *   free(addr, size)                   fsfree() is about to drop a region
+ *   fault-entry(addr, write)           fault handler was entered
+ *   fault-return(addr, size, ns)       fault handler is about to return
+ *   evict(addr, size, dirty)           region is evicted from cache
+ *   db-get(rid, size, ns)              record was read
+ *   db-put(rid, size, ns)              record was written (or appended, rid is then the new one)
+ *   db-put-batch(count, ns)            batch of records was written
+ *   db-del(rid)                        record was deleted
+ * A rid is passed as (pgno << 16 | indx).
+ *
+ * Probe sites are single nops. Latencies are only measured while a tracer
+ * is attached, which is told by probe semaphores. Without <sys/sdt.h>, or
+ * with FSALLOC_NO_PROBES defined, probes are compiled out entirely.
+ */
+
+#if !defined(FSALLOC_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define FSALLOC_HAS_PROBES 1
+#endif
+#endif
+
+#ifdef FSALLOC_HAS_PROBES
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define FSALLOC_PROBE_SEMAPHORE(name) \
+	extern "C" unsigned short fsalloc_##name##_semaphore
+
+FSALLOC_PROBE_SEMAPHORE(alloc);
+FSALLOC_PROBE_SEMAPHORE(free);
+FSALLOC_PROBE_SEMAPHORE(fault__entry);
+FSALLOC_PROBE_SEMAPHORE(fault__return);
+FSALLOC_PROBE_SEMAPHORE(evict);
+FSALLOC_PROBE_SEMAPHORE(db__get);
+FSALLOC_PROBE_SEMAPHORE(db__put);
+FSALLOC_PROBE_SEMAPHORE(db__put__batch);
+FSALLOC_PROBE_SEMAPHORE(db__del);
+
+/*! \brief True iff a tracer is attached to probe */
+#define FSALLOC_PROBE_ENABLED(name) __builtin_expect(fsalloc_##name##_semaphore != 0, 0)
+
+#define FSALLOC_PROBE1(name, a) STAP_PROBE1(fsalloc, name, a)
+#define FSALLOC_PROBE2(name, a, b) STAP_PROBE2(fsalloc, name, a, b)
+#define FSALLOC_PROBE3(name, a, b, c) STAP_PROBE3(fsalloc, name, a, b, c)
+
+#else
+
+#define FSALLOC_PROBE_ENABLED(name) false
+
+// Arguments are never evaluated, but still count as used
+#define FSALLOC_PROBE1(name, a) do { (void)sizeof(+(a)); } while (0)
+#define FSALLOC_PROBE2(name, a, b) do { (void)sizeof(+(a)); (void)sizeof(+(b)); } while (0)
+#define FSALLOC_PROBE3(name, a, b, c) do { (void)sizeof(+(a)); (void)sizeof(+(b)); (void)sizeof(+(c)); } while (0)
+
+#endif
+
+#include <time.h>
+
+#include <cstdint>
+
+namespace fsalloc { namespace probes {
+
+/*! \brief Returns monotonic time in nanoseconds, for latencies passed to probes */
+inline uint64_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+} }
+
+#endif // __FSALLOC_PROBES_H
@@ -0,0 +1,273 @@
+#include "fsalloc/sites.h"
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace fsalloc;
+using namespace fsalloc::sites;
+
+namespace {
+
+const uint32_t kMaxDepth = 32;
+const size_t kSlots = 4096;
+
+/*! \brief Call stack with values attributed to it */
+struct Site {
+	uint64_t hash;                /*!< hash of frames, 0 for an empty slot */
+	uint32_t depth;
+	uintptr_t frames[kMaxDepth];  /*!< innermost frame first */
+	uint64_t values[3];           /*!< indexed by Metric */
+};
+
+/*! \brief Range of addresses taken by a thread's stack */
+struct Bounds {
+	uintptr_t low;
+	uintptr_t high;
+};
+
+/*
+ * Stacks are kept in open addressing tables allocated up front, so that
+ * faults are attributed without allocating. Once a table fills up, new
+ * stacks are dropped.
+ *
+ * gEvery      - sampling period, 0 if disabled
+ * gFaults     - faults left until the next sample
+ * gAllocs     - allocations left until the next sample
+ * gTables     - stacks of each profile
+ * gRegions    - sampled regions with their allocation sites
+ * tBounds     - stack of current thread, walks never leave it; unknown until
+ *               the thread attaches, as finding it allocates
+ */
+uint32_t gEvery;
+uint32_t gFaults;
+uint32_t gAllocs;
+Site *gTables[2];
+std::unordered_map<void *, Site *> gRegions;
+thread_local Bounds tBounds;
+
+}
+
+void fsalloc::sites::attach() {
+	if (tBounds.high == 0) {
+		pthread_attr_t attr;
+		void *stack;
+		size_t size;
+
+		if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+			if (pthread_attr_getstack(&attr, &stack, &size) == 0) {
+				tBounds.low = reinterpret_cast<uintptr_t>(stack);
+				tBounds.high = tBounds.low + size;
+			}
+			pthread_attr_destroy(&attr);
+		}
+	}
+}
+
+/*! \brief Collects return addresses by following frame records [previous fp, return address],
+ * nothing is collected on a thread which did not attach
+ */
+static uint32_t walk(uintptr_t fp, uintptr_t *frames, uint32_t depth) {
+	const Bounds &stack = tBounds;
+
+	while (depth < kMaxDepth && fp >= stack.low && fp + 2 * sizeof(uintptr_t) <= stack.high
+			&& fp % sizeof(uintptr_t) == 0) {
+		const uintptr_t *record = reinterpret_cast<const uintptr_t *>(fp);
+		if (record[1] == 0) {
+			break;
+		}
+		frames[depth++] = record[1];
+		// Frames of callers always lie higher on the stack
+		if (record[0] <= fp) {
+			break;
+		}
+		fp = record[0];
+	}
+	return depth;
+}
+
+/*! \brief Returns the slot of a stack in given table, adding it if needed, or nullptr if table is full */
+static Site *intern(Profile profile, const uintptr_t *frames, uint32_t depth) {
+	Site *table = gTables[static_cast<int>(profile)];
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (uint32_t i = 0; i < depth; ++i) {
+		hash = (hash ^ frames[i]) * 0x100000001b3ULL;
+	}
+	hash |= 1;
+
+	for (size_t probe = 0; probe < kSlots; ++probe) {
+		Site &site = table[(hash + probe) % kSlots];
+		if (site.hash == 0) {
+			site.hash = hash;
+			site.depth = depth;
+			std::copy(frames, frames + depth, site.frames);
+			return &site;
+		}
+		if (site.hash == hash && site.depth == depth && std::equal(frames, frames + depth, site.frames)) {
+			return &site;
+		}
+	}
+	return nullptr;
+}
+
+/*! \brief Returns a readable name of code address */
+static std::string symbolize(uintptr_t addr) {
+	Dl_info info;
+	char buffer[2 * sizeof(uintptr_t) + 3];
+
+	if (dladdr(reinterpret_cast<void *>(addr), &info) && info.dli_sname != nullptr) {
+		int status;
+		char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+		std::string name = status == 0 ? demangled : info.dli_sname;
+		free(demangled);
+		// Semicolons separate frames in folded format
+		std::replace(name.begin(), name.end(), ';', ':');
+		return name;
+	}
+
+	snprintf(buffer, sizeof(buffer), "%#lx", static_cast<unsigned long>(addr));
+	return buffer;
+}
+
+void fsalloc::sites::sampling(uint32_t every) {
+	for (Site *&table : gTables) {
+		if (table != nullptr) {
+			munmap(table, kSlots * sizeof(Site));
+			table = nullptr;
+		}
+	}
+	gRegions.clear();
+	gEvery = 0;
+
+	if (every == 0) {
+		return;
+	}
+
+	for (Site *&table : gTables) {
+		void *slots = mmap(nullptr, kSlots * sizeof(Site), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (slots == MAP_FAILED) {
+			sampling(0);
+			throw std::runtime_error("sites: mmap failed");
+		}
+		table = static_cast<Site *>(slots);
+	}
+	attach();
+	gEvery = gFaults = gAllocs = every;
+}
+
+bool fsalloc::sites::enabled() {
+	return gEvery != 0;
+}
+
+void fsalloc::sites::dump(FILE *out, Profile profile, Metric metric) {
+	Site *table = gTables[static_cast<int>(profile)];
+	std::unordered_map<uintptr_t, std::string> names;
+
+	if (table == nullptr) {
+		return;
+	}
+
+	for (size_t i = 0; i < kSlots; ++i) {
+		const Site &site = table[i];
+		uint64_t value = site.values[static_cast<int>(metric)];
+		if (site.hash == 0 || value == 0) {
+			continue;
+		}
+
+		std::string line;
+		for (uint32_t frame = site.depth; frame-- > 0;) {
+			auto it = names.find(site.frames[frame]);
+			if (it == names.end()) {
+				// Return addresses point past the call, which may already belong to the next function
+				uintptr_t addr = frame == 0 && profile == Profile::access ? site.frames[frame] : site.frames[frame] - 1;
+				it = names.emplace(site.frames[frame], symbolize(addr)).first;
+			}
+			line += it->second;
+			line += frame > 0 ? ";" : "";
+		}
+		fprintf(out, "%s %llu\n", line.c_str(), static_cast<unsigned long long>(value * gEvery));
+	}
+}
+
+void fsalloc::sites::allocated(void *region) {
+	uintptr_t frames[kMaxDepth];
+
+	if (gEvery == 0 || --gAllocs > 0) {
+		return;
+	}
+	gAllocs = gEvery;
+
+	uint32_t depth = walk(reinterpret_cast<uintptr_t>(__builtin_frame_address(0)), frames, 0);
+	Site *site = intern(Profile::allocation, frames, depth);
+	if (site != nullptr) {
+		gRegions[region] = site;
+	}
+}
+
+void fsalloc::sites::freed(void *region) {
+	if (gEvery != 0) {
+		gRegions.erase(region);
+	}
+}
+
+void fsalloc::sites::moved(void *from, void *to) {
+	if (gEvery == 0) {
+		return;
+	}
+
+	auto it = gRegions.find(from);
+	if (it != gRegions.end()) {
+		Site *site = it->second;
+		gRegions.erase(it);
+		gRegions[to] = site;
+	}
+}
+
+void fsalloc::sites::faulted(void *region, uintptr_t pc, uintptr_t fp, uint64_t bytes, uint64_t evictions) {
+	uintptr_t frames[kMaxDepth];
+
+	if (gEvery == 0) {
+		return;
+	}
+
+	auto it = gRegions.find(region);
+	if (it != gRegions.end()) {
+		Site *site = it->second;
+		site->values[static_cast<int>(Metric::faults)]++;
+		site->values[static_cast<int>(Metric::bytes)] += bytes;
+	}
+
+	if (--gFaults > 0) {
+		return;
+	}
+	gFaults = gEvery;
+
+	// Faulting instruction comes first, it may be in a function which did not set up its frame yet
+	frames[0] = pc;
+	Site *site = intern(Profile::access, frames, walk(fp, frames, 1));
+	if (site != nullptr) {
+		site->values[static_cast<int>(Metric::faults)]++;
+		site->values[static_cast<int>(Metric::bytes)] += bytes;
+		site->values[static_cast<int>(Metric::evictions)] += evictions;
+	}
+}
+
+void fsalloc::sites::evicted(void *region) {
+	if (gEvery == 0) {
+		return;
+	}
+
+	auto it = gRegions.find(region);
+	if (it != gRegions.end()) {
+		it->second->values[static_cast<int>(Metric::evictions)]++;
+	}
+}
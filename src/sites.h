@@ -0,0 +1,75 @@
+#ifndef __FSALLOC_SITES_H
+#define __FSALLOC_SITES_H
+
+#include <cstdint>
+#include <cstdio>
+
+namespace fsalloc { namespace sites {
+
+/*
+ * Sampled attribution of faults, fetched bytes and evictions to call stacks.
+ *
+ * Two profiles are gathered:
+ * - access:     stacks of code touching non-resident regions, captured on
+ *               every N-th fault by walking frame pointers from the signal
+ *               context, charged with the fault and whatever it fetched and evicted
+ * - allocation: stacks of every N-th allocation, charged with all faults,
+ *               fetches and evictions of regions allocated there
+ * Counts are scaled by N when dumped. Stacks are only as good as frame
+ * pointers, so the application should be built with -fno-omit-frame-pointer.
+ * Faults of a thread which never allocated are charged to the faulting
+ * instruction alone, as its stack bounds are not known.
+ */
+
+/*! \brief Profile to dump */
+enum class Profile {
+	access,    /*!< stacks of faulting code */
+	allocation /*!< stacks which allocated faulting regions */
+};
+
+/*! \brief Value attributed to stacks */
+enum class Metric {
+	faults,
+	bytes,    /*!< bytes fetched from database */
+	evictions
+};
+
+/*! \brief Samples every 'every'-th fault and allocation, 0 disables sampling and drops gathered stacks */
+void sampling(uint32_t every);
+
+/*! \brief Returns true iff sampling is enabled */
+bool enabled();
+
+/*! \brief Writes a profile in folded stack format, one "frame;frame;... value" line per stack,
+ * outermost frame first - ready for flamegraph.pl or speedscope
+ */
+void dump(FILE *out, Profile profile, Metric metric);
+
+/*! \brief Finds stack bounds of calling thread, which walks need - it allocates, so it is called
+ * by every allocating thread ahead of its faults rather than from the fault handler
+ */
+void attach();
+
+/*! \brief Notes allocation of a region, called directly by the allocating function */
+void allocated(void *region);
+
+/*! \brief Notes a region being freed */
+void freed(void *region);
+
+/*! \brief Notes a handled fault
+ * \param pc        program counter of faulting instruction
+ * \param fp        frame pointer of faulting function
+ * \param bytes     bytes fetched while handling the fault
+ * \param evictions regions evicted while handling the fault
+ */
+void faulted(void *region, uintptr_t pc, uintptr_t fp, uint64_t bytes, uint64_t evictions);
+
+/*! \brief Notes a region moving to another address, which keeps its allocation site */
+void moved(void *from, void *to);
+
+/*! \brief Notes eviction of a region */
+void evicted(void *region);
+
+} }
+
+#endif // __FSALLOC_SITES_H
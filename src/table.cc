@@ -0,0 +1,555 @@
+#include "fsalloc/table.h"
+#include "fsalloc/fsalloc.h"
+
+#include <strings.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <limits>
+#include <stdexcept>
+
+using namespace fsalloc;
+using namespace fsalloc::table;
+
+namespace {
+
+const int kPageShift = ffs(kPagesize) - 1;
+const uint32_t kSpanPages = 1u << kSpanShift;
+// Page numbers stay below kNone, which is never a valid id
+const uint32_t kMaxSpans = (1u << (32 - kSpanShift)) - 1;
+const int kClasses = 33;
+const uint32_t kChunkSlots = 1u << kChunkShift;
+// Back link takes a quarter of columns, see table.h
+const size_t kColumnBytes = 2 * sizeof(uint32_t) + 2 * sizeof(region_t) + sizeof(uint16_t) + sizeof(State);
+const size_t kChunkBytes = kChunkSlots * kColumnBytes;
+const uint32_t kMaxFrames = 1u << 16;
+const uint32_t kNoFrame = std::numeric_limits<uint32_t>::max();
+const uint32_t kMinCapacity = 8;
+
+/*! \brief Part of arena holding slots of a single class */
+struct Span {
+	bool used;
+	uint8_t cls;
+	uint32_t slots; /*!< number of slots handed out so far */
+	uint32_t chunk; /*!< first chunk of columns, only in the first span of a slot larger than a span */
+};
+
+/*! \brief Columns of consecutive slots of a span, resident in a frame or spilled to database */
+struct Chunk {
+	uint32_t frame;     /*!< frame holding columns, or kNoFrame */
+	db::handle_t rid;   /*!< record columns were last spilled to, or invalid handle */
+	uint8_t cls;        /*!< class of span */
+};
+
+/*! \brief Page of RAM holding columns of a single chunk */
+struct Frame {
+	uint32_t chunk;   /*!< chunk held, or next free frame */
+	uint32_t epoch;   /*!< last operation which used frame */
+	bool referenced;  /*!< frame was used since it was last passed by clock */
+	bool used;
+};
+
+/*! \brief Columns of a chunk, pointing into its frame */
+struct Columns {
+	uint32_t *size;
+	uint32_t *pgno;
+	region_t *link;
+	region_t *back;
+	uint16_t *indx;
+	State *state;
+};
+
+/*! \brief Slots of a single class which are free or not handed out yet */
+struct Class {
+	region_t free;     /*!< first of freed slots, linked through their link column */
+	uint32_t span; /*!< last span of the class, slots left there are handed out first */
+};
+
+/*
+ * gBase      - first page of the arena
+ * gSpans     - number of spans reserved
+ * gUsed      - number of spans handed out to classes
+ * gDirectory - every span of the arena
+ * gClasses   - free slots of every class
+ * gCount     - number of regions
+ * gChunks    - every chunk of columns, those of a span are consecutive
+ * gChunkCount - number of chunks handed out to spans
+ * gFrames    - frames of the pool
+ * gPool      - memory of all frames, reserved up front
+ * gFrameCount - number of frames ever used, frames past it are untouched
+ * gFree      - first of free frames, linked through their chunk field
+ * gResident  - number of frames holding a chunk
+ * gCapacity  - number of frames kept once an operation is done
+ * gHand      - clock hand over frames
+ * gEpoch     - number of current operation, frames it used must stay in place until release()
+ */
+char *gBase;
+uint32_t gSpans;
+uint32_t gUsed;
+Span *gDirectory;
+Class gClasses[kClasses];
+size_t gCount;
+Chunk *gChunks;
+uint32_t gChunkCount;
+Frame *gFrames;
+char *gPool;
+uint32_t gFrameCount;
+uint32_t gFree = kNoFrame;
+uint32_t gResident;
+uint32_t gCapacity = kDefaultChunks;
+uint32_t gHand;
+uint32_t gEpoch;
+
+}
+
+/*! \brief Returns class of slots holding a region of given size */
+static int classOf(uint32_t size) {
+	uint64_t pages = (static_cast<uint64_t>(size) + kPagesize - 1) >> kPageShift;
+	int cls = 0;
+	while ((1ULL << cls) < pages) {
+		cls++;
+	}
+	return cls;
+}
+
+/*! \brief Returns number of slots in a span of given class */
+static uint32_t slotsOf(int cls) {
+	return cls <= kSpanShift ? kSpanPages >> cls : 1;
+}
+
+/*! \brief Returns number of slots in a chunk of given class */
+static uint32_t chunkSlotsOf(int cls) {
+	return std::min(slotsOf(cls), kChunkSlots);
+}
+
+static Span &spanOf(region_t id) {
+	return gDirectory[id >> kSpanShift];
+}
+
+/*! \brief Returns index of region within slots of its span */
+static uint32_t slotOf(region_t id) {
+	int cls = spanOf(id).cls;
+	return cls <= kSpanShift ? (id & (kSpanPages - 1)) >> cls : 0;
+}
+
+static void *map(size_t size) {
+	void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED) {
+		throw std::runtime_error("fsalloc: mmap failed");
+	}
+	return addr;
+}
+
+/*! \brief Hands out spans to a class, returns the first one */
+static uint32_t grow(int cls) {
+	uint32_t count = cls <= kSpanShift ? 1 : 1u << (cls - kSpanShift);
+	// Slots larger than a span are aligned, so that their id is computed from any of their pages
+	uint32_t first = (gUsed + count - 1) & ~(count - 1);
+
+	if (first + count > gSpans) {
+		throw std::runtime_error("fsalloc: address space exhausted");
+	}
+
+	uint32_t chunks = slotsOf(cls) / chunkSlotsOf(cls);
+	gDirectory[first].chunk = gChunkCount;
+	for (uint32_t i = 0; i < chunks; ++i) {
+		gChunks[gChunkCount++] = {kNoFrame, Info::invalid_handle, static_cast<uint8_t>(cls)};
+	}
+	for (uint32_t i = first; i < first + count; ++i) {
+		gDirectory[i].used = true;
+		gDirectory[i].cls = cls;
+	}
+
+	gUsed = first + count;
+	return first;
+}
+
+static bool spilled(const Chunk &chunk) {
+	return chunk.rid.pgno != Info::invalid_handle.pgno || chunk.rid.indx != Info::invalid_handle.indx;
+}
+
+/*! \brief Returns size of record holding columns of a chunk of given class */
+static uint32_t recordOf(int cls) {
+	return chunkSlotsOf(cls) * kColumnBytes;
+}
+
+/*! \brief Writes chunk held in a frame to database and frees the frame, returns 0 or error code */
+static int spill(uint32_t frame) {
+	Frame &f = gFrames[frame];
+	Chunk &chunk = gChunks[f.chunk];
+	char *memory = gPool + static_cast<size_t>(frame) * kChunkBytes;
+
+	int err = spilled(chunk) ? db::write(memory, recordOf(chunk.cls), chunk.rid)
+			: db::append(memory, recordOf(chunk.cls), chunk.rid);
+	if (err) {
+		return err;
+	}
+
+	// Dropped pages read back as zeros, which is what a fresh chunk starts with
+	madvise(memory, kChunkBytes, MADV_DONTNEED);
+	chunk.frame = kNoFrame;
+	f.used = false;
+	f.chunk = gFree;
+	gFree = frame;
+	gResident--;
+	return 0;
+}
+
+/*! \brief Returns frame clock picks to spill, skipping those used by current operation, or kNoFrame */
+static uint32_t victim() {
+	for (uint32_t i = 0; i < 2 * gFrameCount; ++i) {
+		uint32_t frame = gHand;
+		Frame &f = gFrames[frame];
+		gHand = gHand + 1 < gFrameCount ? gHand + 1 : 0;
+		if (!f.used || f.epoch == gEpoch) {
+			continue;
+		}
+		if (f.referenced) {
+			f.referenced = false;
+			continue;
+		}
+		return frame;
+	}
+	return kNoFrame;
+}
+/*! \brief Returns a free frame, spilling a chunk not used by current operation if pool is full */
+static uint32_t acquire() {
+	if (gResident >= gCapacity) {
+		uint32_t frame = victim();
+		int err = frame != kNoFrame ? spill(frame) : 0;
+		if (err) {
+			fail("Spilling metadata failed", err);
+		}
+	}
+
+	uint32_t frame = gFree;
+	if (frame != kNoFrame) {
+		gFree = gFrames[frame].chunk;
+	} else if (gFrameCount < kMaxFrames) {
+		// Chunks used by a single operation may take the pool past its capacity until release()
+		frame = gFrameCount++;
+	} else {
+		fail("Metadata frames exhausted", ENOMEM);
+	}
+	return frame;
+}
+
+/*! \brief Returns columns of chunk holding given slot of a span, loading them if they were spilled */
+static Columns columnsOf(const Span &span, uint32_t slot) {
+	uint32_t index = span.chunk + slot / kChunkSlots;
+	Chunk &chunk = gChunks[index];
+
+	if (chunk.frame == kNoFrame) {
+		uint32_t frame = acquire();
+		int err = spilled(chunk) ? db::read(chunk.rid, gPool + static_cast<size_t>(frame) * kChunkBytes,
+				recordOf(chunk.cls)) : 0;
+		if (err) {
+			// Frame is left free, as it was never handed to the chunk
+			gFrames[frame] = {gFree, 0, false, false};
+			gFree = frame;
+			fail("Loading metadata failed", err);
+		}
+		gFrames[frame] = {index, gEpoch, false, true};
+		chunk.frame = frame;
+		gResident++;
+	}
+
+	Frame &frame = gFrames[chunk.frame];
+	frame.epoch = gEpoch;
+	frame.referenced = true;
+
+	size_t slots = chunkSlotsOf(span.cls);
+	char *memory = gPool + static_cast<size_t>(chunk.frame) * kChunkBytes;
+	Columns columns;
+	columns.size = reinterpret_cast<uint32_t *>(memory);
+	columns.pgno = reinterpret_cast<uint32_t *>(memory + slots * sizeof(uint32_t));
+	columns.link = reinterpret_cast<region_t *>(memory + slots * 2 * sizeof(uint32_t));
+	columns.back = reinterpret_cast<region_t *>(memory + slots * 3 * sizeof(uint32_t));
+	columns.indx = reinterpret_cast<uint16_t *>(memory + slots * 4 * sizeof(uint32_t));
+	columns.state = reinterpret_cast<State *>(memory + slots * (4 * sizeof(uint32_t) + sizeof(uint16_t)));
+	return columns;
+}
+
+/*! \brief Returns columns of chunk holding region, along with index of region within them */
+static Columns columnsOf(region_t id, uint32_t &index) {
+	uint32_t slot = slotOf(id);
+	index = slot % kChunkSlots;
+	return columnsOf(spanOf(id), slot);
+}
+
+void fsalloc::table::reset() {
+	if (gBase == nullptr) {
+		// Largest range the system agrees to reserve
+		for (uint32_t spans = kMaxSpans; spans > 0 && gBase == nullptr; spans /= 2) {
+			void *addr = mmap(nullptr, static_cast<size_t>(spans) << (kSpanShift + kPageShift), PROT_NONE,
+					MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+			if (addr != MAP_FAILED) {
+				gBase = static_cast<char *>(addr);
+				gSpans = spans;
+			}
+		}
+		if (gBase == nullptr) {
+			throw std::runtime_error("fsalloc: could not reserve address space");
+		}
+		gDirectory = static_cast<Span *>(map(gSpans * sizeof(Span)));
+		gChunks = static_cast<Chunk *>(map(static_cast<size_t>(gSpans) * (kSpanPages / kChunkSlots) * sizeof(Chunk)));
+		gFrames = static_cast<Frame *>(map(kMaxFrames * sizeof(Frame)));
+		gPool = static_cast<char *>(map(kMaxFrames * kChunkBytes));
+	} else if (gUsed > 0) {
+		void *addr = mmap(gBase, static_cast<size_t>(gUsed) << (kSpanShift + kPageShift), PROT_NONE,
+				MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (addr == MAP_FAILED) {
+			throw std::runtime_error("fsalloc: mmap failed");
+		}
+		// Spilled chunks go away along with the database, which is truncated
+		std::fill(gDirectory, gDirectory + gUsed, Span());
+		madvise(gChunks, gChunkCount * sizeof(Chunk), MADV_DONTNEED);
+		madvise(gFrames, gFrameCount * sizeof(Frame), MADV_DONTNEED);
+		madvise(gPool, gFrameCount * kChunkBytes, MADV_DONTNEED);
+	}
+
+	for (auto &cls : gClasses) {
+		cls = {kNone, kNone};
+	}
+	gUsed = 0;
+	gCount = 0;
+	gChunkCount = 0;
+	gFrameCount = 0;
+	gFree = kNoFrame;
+	gResident = 0;
+	gHand = 0;
+}
+
+void fsalloc::table::release() {
+	uint32_t frame;
+
+	gEpoch++;
+	// A chunk which fails to spill stays resident, to be retried by a later operation
+	while (gResident > gCapacity && (frame = victim()) != kNoFrame && spill(frame) == 0) {
+	}
+}
+
+void fsalloc::table::capacity(uint32_t chunks) {
+	gCapacity = std::max(chunks, kMinCapacity);
+}
+
+Usage fsalloc::table::usage() {
+	Usage usage = {gCapacity, gResident, gChunkCount, 0};
+	for (uint32_t i = 0; i < gChunkCount; ++i) {
+		if (spilled(gChunks[i])) {
+			usage.spilled++;
+		}
+	}
+	return usage;
+}
+
+std::vector<db::handle_t> fsalloc::table::records() {
+	std::vector<db::handle_t> records;
+	for (uint32_t i = 0; i < gChunkCount; ++i) {
+		if (spilled(gChunks[i])) {
+			records.push_back(gChunks[i].rid);
+		}
+	}
+	return records;
+}
+
+region_t fsalloc::table::create(uint32_t size) {
+	region_t id;
+
+	if (size == 0) {
+		throw std::runtime_error("fsalloc: invalid size");
+	}
+
+	int cls = classOf(size);
+	Class &free = gClasses[cls];
+	if (free.free != kNone) {
+		id = free.free;
+		free.free = link(id);
+	} else {
+		if (free.span == kNone || gDirectory[free.span].slots == slotsOf(cls)) {
+			free.span = grow(cls);
+		}
+		id = (free.span << kSpanShift) + (gDirectory[free.span].slots++ << cls);
+	}
+
+	uint32_t slot;
+	Columns columns = columnsOf(id, slot);
+	columns.size[slot] = size;
+	columns.pgno[slot] = Info::invalid_handle.pgno;
+	columns.indx[slot] = Info::invalid_handle.indx;
+	columns.state[slot] = State();
+	columns.link[slot] = kNone;
+	columns.back[slot] = kNone;
+	gCount++;
+	return id;
+}
+
+void fsalloc::table::destroy(region_t id) {
+	if (stored(id)) {
+		unstore(id);
+	}
+
+	Class &free = gClasses[spanOf(id).cls];
+	size(id) = 0;
+	link(id) = free.free;
+	free.free = id;
+	gCount--;
+}
+
+bool fsalloc::table::fits(region_t id, uint32_t size) {
+	return size > 0 && classOf(size) <= spanOf(id).cls;
+}
+
+bool fsalloc::table::owns(const void *addr) {
+	uintptr_t offset = reinterpret_cast<uintptr_t>(addr) - reinterpret_cast<uintptr_t>(gBase);
+	return gBase != nullptr && offset >> (kSpanShift + kPageShift) < gSpans;
+}
+
+region_t fsalloc::table::find(const void *addr) {
+	uintptr_t offset = reinterpret_cast<uintptr_t>(addr) - reinterpret_cast<uintptr_t>(gBase);
+
+	// Addresses below the arena wrap around to large offsets
+	if (offset >> (kSpanShift + kPageShift) >= gUsed) {
+		return kNone;
+	}
+
+	uint32_t page = offset >> kPageShift;
+	const Span &span = gDirectory[page >> kSpanShift];
+	if (!span.used) {
+		return kNone;
+	}
+
+	region_t id = page & ~static_cast<uint32_t>((1ULL << span.cls) - 1);
+	// Slots past those handed out have no columns yet - they are counted in the first span of a slot,
+	// which is not the span of the page for slots larger than a span
+	if (slotOf(id) >= spanOf(id).slots) {
+		return kNone;
+	}
+	uint32_t pages = (static_cast<uint64_t>(size(id)) + kPagesize - 1) >> kPageShift;
+	return page - id < pages ? id : kNone;
+}
+
+void *fsalloc::table::address(region_t id) {
+	return gBase + (static_cast<uintptr_t>(id) << kPageShift);
+}
+
+uint32_t &fsalloc::table::size(region_t id) {
+	uint32_t slot;
+	return columnsOf(id, slot).size[slot];
+}
+
+State &fsalloc::table::state(region_t id) {
+	uint32_t slot;
+	return columnsOf(id, slot).state[slot];
+}
+
+region_t &fsalloc::table::link(region_t id) {
+	uint32_t slot;
+	return columnsOf(id, slot).link[slot];
+}
+
+region_t &fsalloc::table::back(region_t id) {
+	uint32_t slot;
+	return columnsOf(id, slot).back[slot];
+}
+
+db::handle_t fsalloc::table::handle(region_t id) {
+	uint32_t slot;
+	Columns columns = columnsOf(id, slot);
+	db::handle_t rid;
+	rid.pgno = columns.pgno[slot];
+	rid.indx = columns.indx[slot];
+	return rid;
+}
+
+void fsalloc::table::handle(region_t id, const db::handle_t &rid) {
+	uint32_t slot;
+	Columns columns = columnsOf(id, slot);
+	columns.pgno[slot] = rid.pgno;
+	columns.indx[slot] = rid.indx;
+	int err = db::index(rid, id);
+	if (err) {
+		fail("Indexing database entry failed", err);
+	}
+}
+
+bool fsalloc::table::stored(region_t id) {
+	uint32_t slot;
+	Columns columns = columnsOf(id, slot);
+	return columns.pgno[slot] != Info::invalid_handle.pgno || columns.indx[slot] != Info::invalid_handle.indx;
+}
+
+void fsalloc::table::unstore(region_t id) {
+	uint32_t slot;
+	Columns columns = columnsOf(id, slot);
+	int err = db::unindex(handle(id));
+	if (err && err != DB_NOTFOUND) {
+		fail("Dropping database entry from index failed", err);
+	}
+	columns.pgno[slot] = Info::invalid_handle.pgno;
+	columns.indx[slot] = Info::invalid_handle.indx;
+}
+
+size_t fsalloc::table::count() {
+	return gCount;
+}
+
+void fsalloc::table::each(const std::function<void(region_t id)> &visit) {
+	for (uint32_t i = 0; i < gUsed; ++i) {
+		const Span &span = gDirectory[i];
+		if (span.slots == 0) {
+			continue;
+		}
+		for (uint32_t first = 0; first < span.slots; first += kChunkSlots) {
+			Columns columns = columnsOf(span, first);
+			for (uint32_t slot = first; slot < std::min(span.slots, first + kChunkSlots); ++slot) {
+				if (columns.size[slot - first] != 0) {
+					visit((i << kSpanShift) + (slot << span.cls));
+				}
+			}
+			// Walking every region must not page in all of their metadata at once
+			release();
+		}
+	}
+}
+
+intptr_t fsalloc::table::position(const db::handle_t &rid) {
+	return (static_cast<intptr_t>(rid.pgno) << 16) | rid.indx;
+}
+
+/*! \brief Returns database handle at given position */
+static db::handle_t handleAt(intptr_t position) {
+	db::handle_t rid;
+	rid.pgno = position >> 16;
+	rid.indx = position & 0xffff;
+	return rid;
+}
+
+region_t fsalloc::table::at(intptr_t position) {
+	region_t id;
+	int err = db::lookup(handleAt(position), id);
+	if (err && err != DB_NOTFOUND) {
+		fail("Looking up database index failed", err);
+	}
+	return err == 0 ? id : kNone;
+}
+
+/*! \brief Returns position of the nearest stored region in given direction, or 0 if there is none */
+static intptr_t neighbour(intptr_t position, bool forward) {
+	db::handle_t rid = handleAt(position);
+	region_t id;
+	int err = db::neighbour(rid, id, forward);
+	if (err && err != DB_NOTFOUND) {
+		fail("Walking database index failed", err);
+	}
+	return err == 0 ? table::position(rid) : 0;
+}
+
+intptr_t fsalloc::table::next(intptr_t position) {
+	return neighbour(position, true);
+}
+
+intptr_t fsalloc::table::prev(intptr_t position) {
+	return neighbour(position, false);
+}
@@ -0,0 +1,149 @@
+#ifndef __FSALLOC_TABLE_H
+#define __FSALLOC_TABLE_H
+
+#include "fsalloc/db_wrapper.h"
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <vector>
+
+namespace fsalloc { namespace table {
+
+/*
+ * Region metadata, kept in columns indexed by region id.
+ *
+ * Regions live in slots of a single address range reserved up front (arena),
+ * which is divided into spans of 2^kSpanShift pages. Every span holds slots
+ * of a single class - slots of class 'c' are 2^c pages long, and a region
+ * takes the smallest class its pages fit in. Slots larger than a span take
+ * several consecutive spans.
+ *
+ * Id of a region is the number of the first page of its slot within the arena,
+ * so that address of a region and the region containing any address are
+ * computed instead of looked up. Columns take 20 bytes per slot, 4 of them
+ * for the back link, which lets any cached region leave the cache in O(1)
+ * instead of a walk over the queue. Columns are paged (see below), so these
+ * bytes cost database space and frames holding fewer slots, not RAM growing
+ * with the number of regions:
+ *   size  (4) - size of region, 0 for a free slot
+ *   pgno  (4) - database handle of region
+ *   indx  (2)
+ *   state (2) - state bits and fault counter
+ *   link  (4) - next region in cache, or next free slot of the class
+ *   back  (4) - previous region in cache
+ *
+ * Columns are split into chunks of 2^kChunkShift slots, which are paged like
+ * regions themselves: a bounded pool of frames keeps chunks in use, others are
+ * spilled to database. Only the directory of spans and chunks stays in RAM -
+ * a few bytes per chunk - so that RAM taken by metadata does not grow with the
+ * number of regions. References returned below stay valid until release(),
+ * which ends an operation and lets the pool shrink back to its capacity.
+ *
+ * Regions in storage order are kept in a database index, see next() and prev().
+ */
+
+typedef uint32_t region_t;
+
+static const region_t kNone = std::numeric_limits<region_t>::max();
+static const int kSpanShift = 18;
+static const int kChunkShift = 10;
+static const uint32_t kDefaultChunks = 1024;
+
+/*! \brief Usage of frames holding metadata */
+struct Usage {
+	uint32_t capacity; /*!< max number of resident chunks between operations */
+	uint32_t resident; /*!< number of resident chunks */
+	uint64_t chunks;   /*!< number of chunks */
+	uint64_t spilled;  /*!< number of chunks with a copy in database */
+};
+
+/*! \brief State bits and fault counter of a region */
+struct State {
+	uint8_t dirty : 1;      /*!< current state is different than in database */
+	uint8_t cached : 1;     /*!< region is cached in RAM */
+	uint8_t readahead : 1;  /*!< region was read ahead and marks the spot to continue a stream */
+	uint8_t written : 1;    /*!< a write fault hit region during its current residency */
+	uint8_t predicted : 1;  /*!< region was installed writable in anticipation of a write */
+	uint8_t writes : 2;     /*!< likelihood of region being written during its next residency */
+	uint8_t referenced : 1; /*!< region faulted while resident since it was last passed by clock policy */
+	uint8_t heat;           /*!< number of faults on region, saturating */
+};
+
+static_assert(sizeof(State) == 2, "State must be packed in 2 bytes");
+
+/*! \brief Drops all regions, making their pages inaccessible; reserves the arena on first use */
+void reset();
+
+/*! \brief Ends an operation, spilling chunks above capacity; does not throw */
+void release();
+
+/*! \brief Sets number of chunks kept resident between operations */
+void capacity(uint32_t chunks);
+
+Usage usage();
+
+/*! \brief Returns database records holding spilled chunks */
+std::vector<db::handle_t> records();
+
+/*! \brief Takes a free slot for a region of given size, returns its id */
+region_t create(uint32_t size);
+
+/*! \brief Frees slot of a region, dropping it from storage order */
+void destroy(region_t id);
+
+/*! \brief Returns true iff slot of a region can hold 'size' bytes */
+bool fits(region_t id, uint32_t size);
+
+/*! \brief Returns true iff address falls into the arena - safe to call without holding any lock,
+ * as the arena stays in place once reserved
+ */
+bool owns(const void *addr);
+
+/*! \brief Returns id of region which given address falls on any page of, or kNone */
+region_t find(const void *addr);
+
+/*! \brief Returns address of region */
+void *address(region_t id);
+
+uint32_t &size(region_t id);
+
+State &state(region_t id);
+
+region_t &link(region_t id);
+
+region_t &back(region_t id);
+
+/*! \brief Returns database handle of region */
+db::handle_t handle(region_t id);
+
+/*! \brief Sets database handle of a region not stored yet, placing it in storage order */
+void handle(region_t id, const db::handle_t &rid);
+
+/*! \brief Returns true iff region has a record in database */
+bool stored(region_t id);
+
+/*! \brief Forgets database handle of a region, dropping it from storage order */
+void unstore(region_t id);
+
+/*! \brief Returns number of regions */
+size_t count();
+
+/*! \brief Calls 'visit' with every region, in address order, releasing chunks as it goes */
+void each(const std::function<void(region_t id)> &visit);
+
+/*! \brief Returns a key ordering database handles by their position in storage */
+intptr_t position(const db::handle_t &rid);
+
+/*! \brief Returns region stored at given position, or kNone */
+region_t at(intptr_t position);
+
+/*! \brief Returns position of the next stored region, or 0 if there is none */
+intptr_t next(intptr_t position);
+
+/*! \brief Returns position of the previous stored region, or 0 if there is none */
+intptr_t prev(intptr_t position);
+
+} }
+
+#endif // __FSALLOC_TABLE_H
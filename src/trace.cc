@@ -0,0 +1,148 @@
+#include "fsalloc/fsalloc.h"
+#include "fsalloc/trace.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+using namespace fsalloc;
+using namespace fsalloc::trace;
+
+/*
+ * Events are appended to a preallocated buffer of records, which is written
+ * to the trace file whole with plain write() calls once it fills up, and
+ * refilled from its start. Neither recording nor flushing allocates, so both
+ * are fine inside the fault handler.
+ *
+ * gEnabled  - true iff events are recorded
+ * gFd       - descriptor of trace file
+ * gBuffer   - records not written to file yet
+ * gUsed     - number of records in buffer
+ * gStart    - time tracing started, in nanoseconds
+ */
+namespace {
+	bool gEnabled;
+	int gFd = -1;
+	std::vector<Record> gBuffer;
+	size_t gUsed;
+	uint64_t gStart;
+}
+
+/*! \brief Returns monotonic time in nanoseconds */
+static uint64_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/*! \brief Writes whole buffer to file, retrying on partial writes */
+static void writeAll(const void *data, size_t size) {
+	const char *ptr = static_cast<const char *>(data);
+
+	while (size > 0) {
+		ssize_t written = write(gFd, ptr, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// Trace is best effort - stop recording instead of failing the traced process
+			gEnabled = false;
+			return;
+		}
+		ptr += written;
+		size -= written;
+	}
+}
+
+void fsalloc::trace::start(const std::string &path, size_t buffer) {
+	Header header;
+
+	stop();
+
+	gFd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (gFd < 0) {
+		throw std::runtime_error("trace: could not open " + path);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "FSTRACE", 8);
+	header.version = kVersion;
+	header.pagesize = kPagesize;
+
+	gBuffer.assign(buffer > 0 ? buffer : 1, Record());
+	gUsed = 0;
+	gStart = now();
+	gEnabled = true;
+	writeAll(&header, sizeof(header));
+}
+
+void fsalloc::trace::stop() {
+	if (gFd < 0) {
+		return;
+	}
+
+	flush();
+	gEnabled = false;
+	close(gFd);
+	gFd = -1;
+}
+
+bool fsalloc::trace::enabled() {
+	return gEnabled;
+}
+
+void fsalloc::trace::record(Event event, const void *region, uint32_t size, uint8_t flags) {
+	if (!gEnabled) {
+		return;
+	}
+
+	Record &record = gBuffer[gUsed++];
+	record.timestamp = now() - gStart;
+	record.region = reinterpret_cast<uintptr_t>(region);
+	record.size = size;
+	record.event = event;
+	record.flags = flags;
+	record.reserved = 0;
+
+	if (gUsed == gBuffer.size()) {
+		flush();
+	}
+}
+
+void fsalloc::trace::flush() {
+	if (gFd < 0 || gUsed == 0) {
+		return;
+	}
+
+	writeAll(gBuffer.data(), gUsed * sizeof(Record));
+	gUsed = 0;
+}
+
+std::vector<Record> fsalloc::trace::load(const std::string &path) {
+	Header header;
+	std::vector<Record> records;
+	Record record;
+	FILE *file = fopen(path.c_str(), "rb");
+
+	if (!file) {
+		throw std::runtime_error("trace: could not open " + path);
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "FSTRACE", 8) != 0
+			|| header.version != kVersion) {
+		fclose(file);
+		throw std::runtime_error("trace: " + path + " is not a trace file");
+	}
+
+	while (fread(&record, sizeof(record), 1, file) == 1) {
+		records.push_back(record);
+	}
+
+	fclose(file);
+	return records;
+}
@@ -0,0 +1,69 @@
+#ifndef __FSALLOC_TRACE_H
+#define __FSALLOC_TRACE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace fsalloc { namespace trace {
+
+/*! \brief Kind of traced event */
+enum class Event : uint8_t {
+	alloc,       /*!< region was allocated */
+	free,        /*!< region was freed */
+	read_fault,  /*!< region was touched for reading */
+	write_fault, /*!< region was touched for writing */
+	evict        /*!< region was removed from cache */
+};
+
+/*! \brief Flags of traced event */
+enum : uint8_t {
+	kResident = 0x1 /*!< allocation started resident */
+};
+
+/*! \brief Single traced event, as stored in a trace file */
+struct Record {
+	uint64_t timestamp; /*!< nanoseconds since tracing started */
+	uint64_t region;    /*!< region id (its address while it is allocated) */
+	uint32_t size;      /*!< size of region */
+	Event event;
+	uint8_t flags;
+	uint16_t reserved;
+};
+
+/*! \brief Header of a trace file, followed by records */
+struct Header {
+	char magic[8];      /*!< "FSTRACE\0" */
+	uint32_t version;
+	uint32_t pagesize;  /*!< page size of traced process */
+};
+
+static const uint32_t kVersion = 1;
+static const size_t kDefaultBuffer = 64 * 1024;
+
+/*
+ * Recording runs under the lock of fsalloc, which start() and stop() need to
+ * be called with as well - use fsalloc::startTrace() and fsalloc::stopTrace().
+ */
+
+/*! \brief Starts recording events to file at 'path', buffering 'buffer' records in memory */
+void start(const std::string &path, size_t buffer = kDefaultBuffer);
+
+/*! \brief Flushes buffered records and stops recording */
+void stop();
+
+/*! \brief Returns true iff events are recorded */
+bool enabled();
+
+/*! \brief Records an event; safe to call from signal handler */
+void record(Event event, const void *region, uint32_t size, uint8_t flags = 0);
+
+/*! \brief Writes buffered records to file */
+void flush();
+
+/*! \brief Reads all records of a trace file */
+std::vector<Record> load(const std::string &path);
+
+} }
+
+#endif // __FSALLOC_TRACE_H